@@ -0,0 +1,366 @@
+#include <algorithm>
+#include <ctype.h>
+#include <errno.h>
+#include <new>
+#include <png.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "asset_cache.h"
+#include "stats.h"
+#include "utils.h"
+
+// larger files are not images for a led panel
+#define MAX_ASSET_FILE_SIZE (64 * 1024 * 1024)
+#define MAX_ASSET_DIMENSION 16384
+// decoded, all images of a file together; checked before allocating, a
+// small png header can ask for gigabytes
+#define MAX_ASSET_DECODED_BYTES (32 * 1024 * 1024)
+
+static void delete_asset(const asset_t *a)
+{
+	for(size_t i=0; i<a -> images.size(); i++)
+		delete [] a -> images.at(i);
+
+	delete a;
+}
+
+static std::string read_file(const std::string & path)
+{
+	FILE *fh = fopen(path.c_str(), "rb");
+	if (!fh)
+		throw format("cannot open %s: %s", path.c_str(), strerror(errno));
+
+	std::string data;
+	char buffer[65536];
+
+	for(;;)
+	{
+		size_t n = fread(buffer, 1, sizeof buffer, fh);
+		if (n == 0)
+			break;
+
+		data.append(buffer, n);
+
+		if (data.size() > MAX_ASSET_FILE_SIZE)
+		{
+			fclose(fh);
+			throw format("%s is too large", path.c_str());
+		}
+	}
+
+	bool failed = ferror(fh);
+	fclose(fh);
+
+	if (failed)
+		throw format("cannot read %s", path.c_str());
+
+	return data;
+}
+
+// fnv-1a
+static uint64_t hash_data(const std::string & data)
+{
+	uint64_t h = 0xcbf29ce484222325ull;
+
+	for(size_t i=0; i<data.size(); i++)
+	{
+		h ^= uint8_t(data[i]);
+		h *= 0x100000001b3ull;
+	}
+
+	return h;
+}
+
+static void skip_ppm_space(const std::string & data, size_t *const pos)
+{
+	while(*pos < data.size())
+	{
+		if (data[*pos] == '#')
+		{
+			while(*pos < data.size() && data[*pos] != '\n')
+				(*pos)++;
+		}
+		else if (isspace(data[*pos]))
+			(*pos)++;
+		else
+			break;
+	}
+}
+
+static int read_ppm_number(const std::string & data, size_t *const pos)
+{
+	skip_ppm_space(data, pos);
+
+	if (*pos >= data.size() || !isdigit(data[*pos]))
+		throw std::string("ppm header is not valid");
+
+	int v = 0;
+
+	while(*pos < data.size() && isdigit(data[*pos]))
+	{
+		v = v * 10 + data[(*pos)++] - '0';
+
+		if (v > 65535)
+			throw std::string("number in ppm header out of range");
+	}
+
+	return v;
+}
+
+// binary ppm (P6); a file can hold several images of the same size, one after the other
+void decode_ppm(const std::string & data, asset_t *const a)
+{
+	size_t pos = 0;
+
+	while(pos < data.size())
+	{
+		if (data.compare(pos, 2, "P6") != 0)
+			throw std::string("not a binary ppm (P6)");
+
+		pos += 2;
+
+		const int w = read_ppm_number(data, &pos);
+		const int h = read_ppm_number(data, &pos);
+		const int maxval = read_ppm_number(data, &pos);
+
+		// exactly one whitespace character before the pixels
+		pos++;
+
+		if (w < 1 || h < 1 || w > MAX_ASSET_DIMENSION || h > MAX_ASSET_DIMENSION || maxval < 1)
+			throw format("ppm of %dx%d with maxval %d is not supported", w, h, maxval);
+
+		if (a -> images.empty())
+		{
+			a -> w = w;
+			a -> h = h;
+		}
+		else if (w != a -> w || h != a -> h)
+		{
+			throw format("image %zu of the ppm is %dx%d, the first is %dx%d", a -> images.size(), w, h, a -> w, a -> h);
+		}
+
+		const size_t n = size_t(w) * h * 3;
+		const int sample_bytes = maxval < 256 ? 1 : 2;
+
+		if (a -> bytes + n > MAX_ASSET_DECODED_BYTES)
+			throw format("ppm decodes to more than %d MB", MAX_ASSET_DECODED_BYTES / (1024 * 1024));
+
+		if (pos + n * sample_bytes > data.size())
+			throw std::string("ppm is truncated");
+
+		uint8_t *img = new uint8_t[n];
+		const uint8_t *const in = (const uint8_t *)data.data() + pos;
+
+		for(size_t i=0; i<n; i++)
+		{
+			// 16 bit samples are big endian
+			int v = sample_bytes == 1 ? in[i] : (in[i * 2] << 8) | in[i * 2 + 1];
+
+			img[i] = maxval == 255 ? v : std::min(255, v * 255 / maxval);
+		}
+
+		a -> images.push_back(img);
+		a -> bytes += n;
+
+		pos += n * sample_bytes;
+
+		skip_ppm_space(data, &pos);
+	}
+
+	if (a -> images.empty())
+		throw std::string("ppm is empty");
+}
+
+// transparent parts end up black; use "transparent_color":"000000" to let them through
+void decode_png(const std::string & data, asset_t *const a)
+{
+	png_image pi;
+	memset(&pi, 0x00, sizeof pi);
+	pi.version = PNG_IMAGE_VERSION;
+
+	if (!png_image_begin_read_from_memory(&pi, data.data(), data.size()))
+		throw format("png does not decode: %s", pi.message);
+
+	if (pi.width > MAX_ASSET_DIMENSION || pi.height > MAX_ASSET_DIMENSION)
+	{
+		png_image_free(&pi);
+		throw format("png of %ux%u is too large", pi.width, pi.height);
+	}
+
+	pi.format = PNG_FORMAT_RGB;
+
+	const size_t n = PNG_IMAGE_SIZE(pi);
+
+	if (n > MAX_ASSET_DECODED_BYTES)
+	{
+		png_image_free(&pi);
+		throw format("png of %ux%u decodes to more than %d MB", pi.width, pi.height, MAX_ASSET_DECODED_BYTES / (1024 * 1024));
+	}
+
+	// alpha is composed onto what is in the buffer
+	uint8_t *img = new uint8_t[n]();
+
+	if (!png_image_finish_read(&pi, NULL, img, 0, NULL))
+	{
+		delete [] img;
+		throw format("png does not decode: %s", pi.message);
+	}
+
+	a -> w = pi.width;
+	a -> h = pi.height;
+	a -> images.push_back(img);
+	a -> bytes += n;
+}
+
+asset_cache::asset_cache(const size_t max_bytes_in) : bytes(0), max_bytes(max_bytes_in), hits(0), misses(0), evictions(0)
+{
+	pthread_mutex_init(&lock, NULL);
+}
+
+asset_cache::~asset_cache()
+{
+	pthread_mutex_destroy(&lock);
+}
+
+std::string asset_cache::make_key(const std::string & path, const uint64_t hash)
+{
+	return format("%016llx", (unsigned long long)hash) + path;
+}
+
+// drop the least recently used images no element shows anymore
+void asset_cache::evict()
+{
+	std::list<entry_t>::iterator it = lru.end();
+
+	while(bytes > max_bytes && it != lru.begin())
+	{
+		it--;
+
+		// still shown: freeing it would not save anything
+		if (it -> a.use_count() > 1)
+			continue;
+
+		bytes -= it -> a -> bytes;
+		index.erase(make_key(it -> a -> path, it -> a -> hash));
+		it = lru.erase(it);
+
+		evictions++;
+	}
+}
+
+asset_ptr_t asset_cache::get(const std::string & path)
+{
+	// reading and hashing the file is cheap compared to decoding it
+	const std::string data = read_file(path);
+	const uint64_t hash = hash_data(data);
+	const std::string key = make_key(path, hash);
+
+	pthread_mutex_lock(&lock);
+
+	std::unordered_map<std::string, std::list<entry_t>::iterator>::iterator it = index.find(key);
+	if (it != index.end())
+	{
+		hits++;
+		it -> second -> hits++;
+
+		lru.splice(lru.begin(), lru, it -> second);
+
+		asset_ptr_t result = it -> second -> a;
+
+		pthread_mutex_unlock(&lock);
+
+		return result;
+	}
+
+	misses++;
+
+	pthread_mutex_unlock(&lock);
+
+	// decoding is done without the lock: it can take a while
+	asset_t *a = new asset_t;
+	a -> path = path;
+	a -> hash = hash;
+	a -> w = a -> h = 0;
+	a -> bytes = 0;
+
+	try
+	{
+		stage_timer t(STAGE_IMAGE_DECODE);
+
+		if (data.compare(0, 8, "\x89PNG\r\n\x1a\n") == 0)
+			decode_png(data, a);
+		else
+			decode_ppm(data, a);
+	}
+	catch(const std::string & e)
+	{
+		delete_asset(a);
+
+		throw path + ": " + e;
+	}
+	catch(const std::bad_alloc & e)
+	{
+		delete_asset(a);
+
+		throw path + ": out of memory while decoding";
+	}
+
+	asset_ptr_t result(a, delete_asset);
+
+	pthread_mutex_lock(&lock);
+
+	// someone else decoded the same file meanwhile: share theirs
+	it = index.find(key);
+	if (it != index.end())
+	{
+		result = it -> second -> a;
+	}
+	else
+	{
+		entry_t e = { result, 0 };
+		lru.push_front(e);
+		index.insert(std::pair<std::string, std::list<entry_t>::iterator>(key, lru.begin()));
+
+		bytes += a -> bytes;
+
+		evict();
+	}
+
+	pthread_mutex_unlock(&lock);
+
+	return result;
+}
+
+void asset_cache::get_stats(asset_cache_stats_t *const stats)
+{
+	pthread_mutex_lock(&lock);
+
+	stats -> hits = hits;
+	stats -> misses = misses;
+	stats -> evictions = evictions;
+	stats -> n_assets = lru.size();
+	stats -> bytes = bytes;
+	stats -> max_bytes = max_bytes;
+
+	stats -> assets.clear();
+
+	for(std::list<entry_t>::const_iterator it = lru.begin(); it != lru.end(); it++)
+	{
+		const asset_t *const a = it -> a.get();
+
+		asset_info_t ai;
+		ai.path = a -> path;
+		ai.hash = a -> hash;
+		ai.w = a -> w;
+		ai.h = a -> h;
+		ai.n_images = a -> images.size();
+		ai.bytes = a -> bytes;
+		ai.users = it -> a.use_count() - 1;
+		ai.hits = it -> hits;
+
+		stats -> assets.push_back(ai);
+	}
+
+	pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,75 @@
+#ifndef __ASSET_CACHE_H__
+#define __ASSET_CACHE_H__
+
+#include <list>
+#include <memory>
+#include <pthread.h>
+#include <stdint.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// decoded images nobody shows are dropped when they take more than this
+#define DEFAULT_ASSET_CACHE_SIZE (16 * 1024 * 1024)
+
+// a decoded image file: one image for png, one or more for a (multi image) ppm
+typedef struct {
+	std::string path;
+	uint64_t hash; // of the file contents
+	int w, h; // of each image
+	std::vector<uint8_t *> images; // w * h * 3 bytes each, rgb
+	size_t bytes;
+} asset_t;
+
+typedef std::shared_ptr<const asset_t> asset_ptr_t;
+
+typedef struct {
+	std::string path;
+	uint64_t hash;
+	int w, h, n_images;
+	size_t bytes;
+	long users; // elements showing it
+	uint64_t hits;
+} asset_info_t;
+
+typedef struct {
+	uint64_t hits, misses, evictions;
+	size_t n_assets, bytes, max_bytes;
+	std::vector<asset_info_t> assets;
+} asset_cache_stats_t;
+
+// image files, decoded once and shared by every element that shows them;
+// keyed by path and contents so that a changed file is decoded again
+class asset_cache {
+private:
+	typedef struct {
+		asset_ptr_t a;
+		uint64_t hits;
+	} entry_t;
+
+	std::list<entry_t> lru; // front is most recently used
+	std::unordered_map<std::string, std::list<entry_t>::iterator> index;
+
+	size_t bytes, max_bytes;
+	uint64_t hits, misses, evictions;
+
+	pthread_mutex_t lock;
+
+	static std::string make_key(const std::string & path, const uint64_t hash);
+	void evict();
+
+public:
+	asset_cache(const size_t max_bytes_in);
+	virtual ~asset_cache();
+
+	// throws a std::string when the file cannot be read or decoded
+	asset_ptr_t get(const std::string & path);
+
+	void get_stats(asset_cache_stats_t *const stats);
+};
+
+// throw a std::string when the data is not a valid image of their type
+void decode_ppm(const std::string & data, asset_t *const a);
+void decode_png(const std::string & data, asset_t *const a);
+
+#endif
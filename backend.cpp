@@ -0,0 +1,158 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "backend.h"
+#include "error.h"
+#include "log.h"
+
+matrix_backend::matrix_backend(rgb_matrix::RGBMatrix *const m_in) : m(m_in)
+{
+}
+
+matrix_backend::~matrix_backend()
+{
+}
+
+rgb_matrix::Canvas *matrix_backend::create_offscreen()
+{
+	return m -> CreateFrameCanvas();
+}
+
+rgb_matrix::Canvas *matrix_backend::swap(rgb_matrix::Canvas *const c)
+{
+	// only frame canvases created above come here
+	return m -> SwapOnVSync(static_cast<rgb_matrix::FrameCanvas *>(c));
+}
+
+raw_file_sink::raw_file_sink(const std::string & filename)
+{
+	fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+	if (fd == -1)
+		error_exit(true, "cannot open %s", filename.c_str());
+}
+
+raw_file_sink::~raw_file_sink()
+{
+	if (fd != -1)
+		close(fd);
+}
+
+void raw_file_sink::put_frame(const uint8_t *const rgb, const int w, const int h)
+{
+	if (fd == -1)
+		return;
+
+	const size_t n = w * h * 3;
+
+	for(size_t done = 0; done < n;)
+	{
+		ssize_t rc = write(fd, &rgb[done], n - done);
+
+		if (rc == -1)
+		{
+			if (errno == EINTR)
+				continue;
+
+			// e.g. the reader of the pipe went away or the disk is full:
+			// stop writing for good, a later frame would be misaligned
+			log_msg(LL_ERROR, "frame sink: %s, no more frames are written", strerror(errno));
+
+			close(fd);
+			fd = -1;
+
+			break;
+		}
+
+		done += rc;
+	}
+}
+
+shm_sink::shm_sink(const std::string & name_in, const int w, const int h) : name(name_in)
+{
+	size = sizeof(shm_frame_header_t) + w * h * 3;
+
+	int fd = shm_open(name.c_str(), O_RDWR | O_CREAT, 0644);
+	if (fd == -1)
+		error_exit(true, "cannot create shared memory object %s", name.c_str());
+
+	if (ftruncate(fd, size) == -1)
+		error_exit(true, "cannot size shared memory object %s", name.c_str());
+
+	void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED)
+		error_exit(true, "cannot map shared memory object %s", name.c_str());
+
+	close(fd);
+
+	header = (shm_frame_header_t *)p;
+	header -> magic = SHM_FRAME_MAGIC;
+	header -> w = w;
+	header -> h = h;
+	header -> seq = 0;
+	header -> frame_nr = 0;
+}
+
+shm_sink::~shm_sink()
+{
+	munmap(header, size);
+
+	shm_unlink(name.c_str());
+}
+
+void shm_sink::put_frame(const uint8_t *const rgb, const int w, const int h)
+{
+	header -> seq++;
+	__sync_synchronize();
+
+	memcpy(header + 1, rgb, w * h * 3);
+	header -> frame_nr++;
+
+	__sync_synchronize();
+	header -> seq++;
+}
+
+memory_backend::memory_backend(const int w_in, const int h_in) : w(w_in), h(h_in), live(w_in, h_in), shown(&live)
+{
+}
+
+memory_backend::~memory_backend()
+{
+	for(size_t i=0; i<sinks.size(); i++)
+		delete sinks.at(i);
+
+	for(size_t i=0; i<offscreen.size(); i++)
+		delete offscreen.at(i);
+}
+
+void memory_backend::add_sink(frame_sink *const s)
+{
+	sinks.push_back(s);
+}
+
+rgb_matrix::Canvas *memory_backend::create_offscreen()
+{
+	memory_canvas *c = new memory_canvas(w, h);
+
+	offscreen.push_back(c);
+
+	return c;
+}
+
+rgb_matrix::Canvas *memory_backend::swap(rgb_matrix::Canvas *const c)
+{
+	const uint8_t *const pixels = static_cast<memory_canvas *>(c) -> get_pixels();
+
+	for(size_t i=0; i<sinks.size(); i++)
+		sinks.at(i) -> put_frame(pixels, w, h);
+
+	rgb_matrix::Canvas *prev = shown;
+	shown = c;
+
+	return prev;
+}
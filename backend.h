@@ -0,0 +1,118 @@
+#ifndef __BACKEND_H__
+#define __BACKEND_H__
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "led-matrix.h"
+#include "memory_canvas.h"
+
+// where the frames go: the led panels or memory
+class display_backend {
+public:
+	virtual ~display_backend() { }
+
+	virtual int width() const = 0;
+	virtual int height() const = 0;
+
+	// what is on the display right now
+	virtual rgb_matrix::Canvas *get_live_canvas() = 0;
+
+	// false when frames can only be drawn into the live canvas
+	virtual bool has_offscreen() const = 0;
+	virtual rgb_matrix::Canvas *create_offscreen() = 0;
+	// shows the offscreen canvas c, returns the one that was shown before
+	virtual rgb_matrix::Canvas *swap(rgb_matrix::Canvas *const c) = 0;
+};
+
+class matrix_backend : public display_backend {
+private:
+	rgb_matrix::RGBMatrix *const m;
+
+public:
+	matrix_backend(rgb_matrix::RGBMatrix *const m_in);
+	virtual ~matrix_backend();
+
+	int width() const { return m -> width(); }
+	int height() const { return m -> height(); }
+
+	rgb_matrix::Canvas *get_live_canvas() { return m; }
+
+	bool has_offscreen() const { return true; }
+	rgb_matrix::Canvas *create_offscreen();
+	// waits for the vsync
+	rgb_matrix::Canvas *swap(rgb_matrix::Canvas *const c);
+};
+
+// receives every frame shown by the memory backend
+class frame_sink {
+public:
+	virtual ~frame_sink() { }
+
+	virtual void put_frame(const uint8_t *const rgb, const int w, const int h) = 0;
+};
+
+// raw rgb frames, one after the other, to a file or a pipe
+class raw_file_sink : public frame_sink {
+private:
+	int fd;
+
+public:
+	raw_file_sink(const std::string & filename);
+	virtual ~raw_file_sink();
+
+	void put_frame(const uint8_t *const rgb, const int w, const int h);
+};
+
+#define SHM_FRAME_MAGIC 0x4d534652 // "MSFR"
+
+// the shared memory object starts with this header, the pixels follow it
+typedef struct {
+	uint32_t magic, w, h;
+	// odd while a frame is being written: readers retry when it changed
+	volatile uint32_t seq;
+	uint64_t frame_nr;
+} shm_frame_header_t;
+
+// the latest frame in a posix shared memory object
+class shm_sink : public frame_sink {
+private:
+	const std::string name;
+	shm_frame_header_t *header;
+	size_t size;
+
+public:
+	shm_sink(const std::string & name_in, const int w, const int h);
+	virtual ~shm_sink();
+
+	void put_frame(const uint8_t *const rgb, const int w, const int h);
+};
+
+// no hardware at all: frames are memory canvases, optionally copied to sinks
+class memory_backend : public display_backend {
+private:
+	const int w, h;
+	memory_canvas live;
+	rgb_matrix::Canvas *shown;
+	std::vector<memory_canvas *> offscreen;
+	std::vector<frame_sink *> sinks;
+
+public:
+	memory_backend(const int w_in, const int h_in);
+	virtual ~memory_backend();
+
+	// takes ownership
+	void add_sink(frame_sink *const s);
+
+	int width() const { return w; }
+	int height() const { return h; }
+
+	rgb_matrix::Canvas *get_live_canvas() { return &live; }
+
+	bool has_offscreen() const { return true; }
+	rgb_matrix::Canvas *create_offscreen();
+	rgb_matrix::Canvas *swap(rgb_matrix::Canvas *const c);
+};
+
+#endif
@@ -0,0 +1,689 @@
+// microbenchmarks, run with "make bench"; the results go to stdout as json
+// so that the output of two builds can be compared
+#include <algorithm>
+#include <atomic>
+#include <fcntl.h>
+#include <jansson.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+#include "binary_command.h"
+#include "blit.h"
+#include "commands.h"
+#include "compositor.h"
+#include "damage.h"
+#include "double_buffer.h"
+#include "font.h"
+#include "frame_pusher.h"
+#include "memory_canvas.h"
+#include "scene.h"
+#include "scheduler.h"
+#include "stats.h"
+#include "utils.h"
+
+// every malloc(), calloc() and realloc() in the process is counted, this
+// includes operator new, jansson and freetype
+static std::atomic_ulong n_allocs(0);
+
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t n, size_t size);
+void *__libc_realloc(void *p, size_t size);
+
+void *malloc(size_t size) __THROW
+{
+	n_allocs++;
+
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size) __THROW
+{
+	n_allocs++;
+
+	return __libc_calloc(n, size);
+}
+
+void *realloc(void *p, size_t size) __THROW
+{
+	n_allocs++;
+
+	return __libc_realloc(p, size);
+}
+}
+
+// one iteration of a benchmark
+typedef void (*bench_function_t)(void *const ctx, const int i);
+
+static int64_t min_run_ns = 300 * 1000000ll;
+static json_t *results = NULL;
+static FILE *out = NULL, *err = NULL;
+
+static int64_t get_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000ll + ts.tv_nsec;
+}
+
+// doubles the number of iterations until a run takes at least min_run_ns;
+// returns its entry in the results
+static json_t *run_bench(const std::string & name, const bench_function_t f, void *const ctx)
+{
+	int64_t took = 0;
+	unsigned long allocs = 0;
+	int n = 1;
+
+	f(ctx, 0); // warm up caches
+
+	for(;;)
+	{
+		const unsigned long start_allocs = n_allocs;
+		const int64_t start = get_ns();
+
+		for(int i=0; i<n; i++)
+			f(ctx, i);
+
+		took = get_ns() - start;
+		allocs = n_allocs - start_allocs;
+
+		if (took >= min_run_ns || n >= (1 << 30))
+			break;
+
+		n *= 2;
+	}
+
+	json_t *entry = json_object();
+	json_object_set_new(entry, "name", json_string(name.c_str()));
+	json_object_set_new(entry, "iterations", json_integer(n));
+	json_object_set_new(entry, "ns_per_op", json_real(double(took) / n));
+	json_object_set_new(entry, "allocs_per_op", json_real(double(allocs) / n));
+	json_array_append_new(results, entry);
+
+	fprintf(err, "%-40s %12.0f ns/op %10.2f allocs/op\n", name.c_str(), double(took) / n, double(allocs) / n);
+
+	return entry;
+}
+
+static std::string make_text(const int len)
+{
+	const std::string words = "The quick brown fox jumps over the lazy dog. ";
+	std::string text;
+
+	while(int(text.size()) < len)
+		text += words;
+
+	return text.substr(0, len);
+}
+
+typedef struct {
+	std::string font_file, text;
+	int h;
+	bool antialias;
+} font_ctx_t;
+
+static void do_font_render(void *const ctx, const int i)
+{
+	const font_ctx_t *const fc = (const font_ctx_t *)ctx;
+
+	font f(fc -> font_file, fc -> text, fc -> h, fc -> antialias);
+}
+
+static void bench_font_render(const std::string & font_file)
+{
+	const int heights[] = { 16, 32, 64 };
+	const int lengths[] = { 10, 100 };
+
+	for(int hi=0; hi<3; hi++)
+	{
+		for(int li=0; li<2; li++)
+		{
+			for(int aa=1; aa>=0; aa--)
+			{
+				font_ctx_t fc;
+				fc.font_file = font_file;
+				fc.text = make_text(lengths[li]);
+				fc.h = heights[hi];
+				fc.antialias = aa;
+
+				run_bench(format("font_render/h%d/len%d/%s", fc.h, lengths[li], aa ? "aa" : "mono"), do_font_render, &fc);
+			}
+		}
+	}
+}
+
+#define RENDERS_PER_BURST 48
+
+typedef struct {
+	std::string font_file;
+	std::vector<std::string> texts;
+	int n_threads;
+	std::atomic_int next;
+} burst_ctx_t;
+
+static void *burst_thread(void *p)
+{
+	burst_ctx_t *const bc = (burst_ctx_t *)p;
+
+	for(;;)
+	{
+		const int i = bc -> next++;
+		if (i >= RENDERS_PER_BURST)
+			break;
+
+		font f(bc -> font_file, bc -> texts.at(i % bc -> texts.size()), 16 + (i % 4) * 8, true);
+	}
+
+	return NULL;
+}
+
+// a burst of add_texts arriving at once, rendered by n_threads threads
+static void do_font_render_burst(void *const ctx, const int i)
+{
+	burst_ctx_t *const bc = (burst_ctx_t *)ctx;
+	bc -> next = 0;
+
+	std::vector<pthread_t> threads(bc -> n_threads - 1);
+
+	for(size_t t=0; t<threads.size(); t++)
+		pthread_create(&threads.at(t), NULL, burst_thread, bc);
+
+	burst_thread(bc);
+
+	for(size_t t=0; t<threads.size(); t++)
+		pthread_join(threads.at(t), NULL);
+}
+
+// without glyph cache, so that every glyph is rasterized; "speedup" is relative to 1 thread
+static void bench_font_render_threads(const std::string & font_file)
+{
+	burst_ctx_t bc;
+	bc.font_file = font_file;
+
+	for(int i=0; i<8; i++)
+		bc.texts.push_back(make_text(20 + i * 5));
+
+	font::set_glyph_cache_size(0);
+
+	double single_ns = 0;
+
+	for(int threads=1; threads<=4; threads++)
+	{
+		bc.n_threads = threads;
+
+		json_t *entry = run_bench(format("font_render_burst/%d_texts/%d_threads", RENDERS_PER_BURST, threads), do_font_render_burst, &bc);
+
+		const double ns = json_real_value(json_object_get(entry, "ns_per_op"));
+
+		if (threads == 1)
+			single_ns = ns;
+
+		json_object_set_new(entry, "speedup", json_real(single_ns / ns));
+		fprintf(err, "%-40s %12.2f x the speed of 1 thread\n", "", single_ns / ns);
+	}
+
+	font::set_glyph_cache_size(DEFAULT_GLYPH_CACHE_SIZE);
+}
+
+typedef struct {
+	uint8_t *target, *source;
+	int w, h;
+	blit_op_t op;
+} blit_ctx_t;
+
+static void do_bitblit(void *const ctx, const int i)
+{
+	const blit_ctx_t *const bc = (const blit_ctx_t *)ctx;
+
+	bitblit(bc -> target, bc -> w, bc -> h, 0, 0, bc -> source, bc -> w, bc -> h, 0, 0, bc -> w, bc -> h, &bc -> op);
+}
+
+static void bench_bitblit(const int w, const int h)
+{
+	blit_ctx_t bc;
+	bc.w = w;
+	bc.h = h;
+	bc.target = new uint8_t[w * h * 3];
+	bc.source = new uint8_t[w * h * 3];
+
+	for(int i=0; i<w * h * 3; i++)
+		bc.target[i] = rand();
+
+	// a quarter of the source is the key color, like the background of a text
+	for(int i=0; i<w * h; i++)
+	{
+		const bool key = (rand() & 3) == 0;
+
+		for(int c=0; c<3; c++)
+			bc.source[i * 3 + c] = key ? 0 : rand();
+	}
+
+	const char *const names[] = { "opaque", "color_key", "alpha", "color_key_alpha" };
+	const char *const keys[] = { "", "#000000", "", "#000000" };
+	const int alphas[] = { -1, -1, 50, 50 };
+
+	for(int m=0; m<4; m++)
+	{
+		init_blit_op(&bc.op, keys[m], alphas[m]);
+
+		run_bench(format("bitblit/%s/%dx%d", names[m], w, h), do_bitblit, &bc);
+	}
+
+	delete [] bc.source;
+	delete [] bc.target;
+}
+
+// what the server has: a frame, a scene with its lock and a scheduler that
+// is never started, so elements stay where they are put
+typedef struct {
+	double_buffer_t db;
+	std::atomic_int brightness;
+	pthread_rwlock_t clients_lock;
+	scene *clients;
+	scheduler *s;
+} server_ctx_t;
+
+static void init_server(server_ctx_t *const sc, const int w, const int h, const std::string & font_file)
+{
+	sc -> brightness = 50;
+
+	sc -> db.w = w;
+	sc -> db.h = h;
+	sc -> db.data = new uint8_t[w * h * 3];
+	sc -> db.brightness = &sc -> brightness;
+	sc -> db.flag = sc -> db.want_flash = false;
+	sc -> db.dirty = new damage_tracker(w, h);
+	sc -> db.screensaver = false;
+	sc -> db.pacer = NULL;
+	sc -> db.traces = NULL;
+	sc -> db.assets = NULL;
+	sc -> db.font_name = font_file;
+
+	pthread_rwlock_init(&sc -> clients_lock, NULL);
+
+	sc -> clients = new scene();
+	sc -> s = new scheduler(step_display_element);
+}
+
+static void uninit_server(server_ctx_t *const sc)
+{
+	scene::iterator it = sc -> clients -> begin();
+	for(; it != sc -> clients -> end(); it++)
+		sc -> clients -> terminate(it -> second);
+
+	for(it = sc -> clients -> begin(); it != sc -> clients -> end();)
+	{
+		disp_element_t *const de = it -> second;
+
+		sc -> clients -> erase(it++);
+
+		delete_element(de);
+	}
+
+	delete sc -> s;
+	delete sc -> clients;
+
+	pthread_rwlock_destroy(&sc -> clients_lock);
+
+	delete sc -> db.dirty;
+	delete [] sc -> db.data;
+}
+
+typedef struct {
+	server_ctx_t *sc;
+	compositor *comp;
+	std::vector<rect_t> rects;
+	std::vector<rect_t> damage;
+	int n_damage;
+} compose_ctx_t;
+
+static void do_compose(void *const ctx, const int i)
+{
+	compose_ctx_t *const cc = (compose_ctx_t *)ctx;
+
+	const rect_t & r = cc -> damage.at(i % cc -> n_damage);
+	cc -> sc -> db.dirty -> add(r.x, r.y, r.w, r.h);
+
+	cc -> comp -> compose(&cc -> rects);
+}
+
+static void bench_compose(const std::string & font_file, const int w, const int h)
+{
+	const int counts[] = { 1, 10, 100, 1000 };
+
+	for(int ci=0; ci<4; ci++)
+	{
+		server_ctx_t sc;
+		init_server(&sc, w, h, font_file);
+
+		compose_ctx_t cc;
+		cc.sc = &sc;
+		cc.comp = new compositor(&sc.db, &sc.clients_lock, sc.clients, DEFAULT_COMPOSE_THREADS);
+		cc.rects.reserve(MAX_DAMAGE_RECTS + 1);
+
+		// tickers of different sizes all over the display, some transparent
+		for(int e=0; e<counts[ci]; e++)
+		{
+			const int ew = std::min(w, 32 + (e * 13) % 96), eh = std::min(h, 16 + (e % 2) * 16);
+			const int ex = (e * 37) % (w - ew + 1), ey = (e * 11) % (h - eh + 1);
+			const char *const blend = e % 3 == 1 ? ",\"transparent_color\":\"#000000\"" : e % 3 == 2 ? ",\"alpha\":60" : "";
+
+			std::string cmd = format("{\"cmd\":\"add_text\",\"id\":\"e%d\",\"x\":%d,\"y\":%d,\"w\":%d,\"h\":%d,\"z_depth\":%d,\"prio\":0,\"text\":\"%s\"%s}", e, ex, ey, ew, eh, e % 256, make_text(20 + e % 30).c_str(), blend);
+
+			process_json_request(cmd, get_mono_ns(), sc.s, &sc.db, &sc.clients_lock, sc.clients, &sc.brightness, NULL);
+
+			cc.damage.push_back(rect_t { ex, ey, ew, eh });
+		}
+
+		// everything, as after a brightness change
+		rect_t all = { 0, 0, w, h };
+		cc.damage.insert(cc.damage.begin(), all);
+		cc.n_damage = 1;
+
+		run_bench(format("compose/%d_elements/full", counts[ci]), do_compose, &cc);
+
+		// one element moved per frame, the usual case
+		cc.damage.erase(cc.damage.begin());
+		cc.n_damage = cc.damage.size();
+
+		run_bench(format("compose/%d_elements/one_element", counts[ci]), do_compose, &cc);
+
+		delete cc.comp;
+
+		uninit_server(&sc);
+	}
+}
+
+// a panel wall full of alpha blended zones, recomposed completely by 1 to 4
+// threads; "speedup" is relative to 1
+static void bench_compose_threads(const std::string & font_file, const int w, const int h, const int n_elements)
+{
+	server_ctx_t sc;
+	init_server(&sc, w, h, font_file);
+
+	for(int e=0; e<n_elements; e++)
+	{
+		const int ew = std::min(w, 48 + (e * 13) % 64), eh = std::min(h, 16 + (e % 3) * 8);
+		const int ex = (e * 37) % (w - ew + 1), ey = (e * 11) % (h - eh + 1);
+
+		std::string cmd = format("{\"cmd\":\"add_text\",\"id\":\"e%d\",\"x\":%d,\"y\":%d,\"w\":%d,\"h\":%d,\"z_depth\":%d,\"prio\":0,\"alpha\":%d,\"text\":\"%s\"}", e, ex, ey, ew, eh, e % 256, 30 + e % 60, make_text(20 + e % 30).c_str());
+
+		process_json_request(cmd, get_mono_ns(), sc.s, &sc.db, &sc.clients_lock, sc.clients, &sc.brightness, NULL);
+	}
+
+	double single_ns = 0;
+
+	for(int threads=1; threads<=4; threads++)
+	{
+		compose_ctx_t cc;
+		cc.sc = &sc;
+		cc.comp = new compositor(&sc.db, &sc.clients_lock, sc.clients, threads);
+		cc.rects.reserve(MAX_DAMAGE_RECTS + 1);
+		cc.damage.push_back(rect_t { 0, 0, w, h });
+		cc.n_damage = 1;
+
+		json_t *entry = run_bench(format("compose/%dx%d/%d_alpha/%d_threads", w, h, n_elements, threads), do_compose, &cc);
+
+		const double ns = json_real_value(json_object_get(entry, "ns_per_op"));
+
+		if (threads == 1)
+			single_ns = ns;
+
+		json_object_set_new(entry, "speedup", json_real(single_ns / ns));
+		fprintf(err, "%-40s %12.2f x the speed of 1 thread\n", "", single_ns / ns);
+
+		delete cc.comp;
+	}
+
+	uninit_server(&sc);
+}
+
+typedef struct {
+	server_ctx_t *sc;
+	std::vector<std::string> msgs;
+	bool want_reply;
+} request_ctx_t;
+
+static void do_request(void *const ctx, const int i)
+{
+	request_ctx_t *const rc = (request_ctx_t *)ctx;
+	server_ctx_t *const sc = rc -> sc;
+
+	std::string reply;
+
+	process_json_request(rc -> msgs.at(i % rc -> msgs.size()), get_mono_ns(), sc -> s, &sc -> db, &sc -> clients_lock, sc -> clients, &sc -> brightness, rc -> want_reply ? &reply : NULL);
+}
+
+static void do_binary_request(void *const ctx, const int i)
+{
+	request_ctx_t *const rc = (request_ctx_t *)ctx;
+	server_ctx_t *const sc = rc -> sc;
+
+	process_binary_command(rc -> msgs.at(i % rc -> msgs.size()), get_mono_ns(), sc -> s, &sc -> db, &sc -> clients_lock, sc -> clients, &sc -> brightness, NULL);
+}
+
+static std::string binary_add_text(const char *const text)
+{
+	binary_add_text_t bat;
+	memset(&bat, 0x00, sizeof bat);
+	bat.w = 64;
+	bat.h = 16;
+	bat.pps = 20;
+	bat.flags = BTF_PRIO | BTF_REPEAT_WRAP | BTF_MOVE_LEFT | BTF_ANTIALIAS;
+	bat.alpha = -1;
+
+	uint8_t buffer[512];
+	size_t n = binary_encode_add_text(buffer, 0, 0, bat, "ticker", NULL, text);
+
+	return std::string((const char *)buffer, n);
+}
+
+static void bench_request(const std::string & font_file, const int w, const int h)
+{
+	server_ctx_t sc;
+	init_server(&sc, w, h, font_file);
+
+	request_ctx_t rc;
+	rc.sc = &sc;
+	rc.want_reply = false;
+
+	// same id and layout: only the text is rendered and swapped in
+	rc.msgs.push_back("{\"cmd\":\"add_text\",\"id\":\"ticker\",\"x\":0,\"y\":0,\"w\":64,\"h\":16,\"pps\":20,\"text\":\"12:00 Departure platform 3\"}");
+	rc.msgs.push_back("{\"cmd\":\"add_text\",\"id\":\"ticker\",\"x\":0,\"y\":0,\"w\":64,\"h\":16,\"pps\":20,\"text\":\"12:01 Departure platform 4\"}");
+	run_bench("process_json_request/add_text_replace", do_request, &rc);
+
+	rc.msgs.clear();
+	rc.msgs.push_back("{\"cmd\":\"brightness\",\"brightness\":40}");
+	run_bench("process_json_request/brightness", do_request, &rc);
+
+	rc.msgs.clear();
+	rc.msgs.push_back("{\"cmd\":\"brightness\",\"brightness\":40,\"ack\":1,\"seq\":12345}");
+	rc.want_reply = true;
+	run_bench("process_json_request/brightness_ack", do_request, &rc);
+	rc.want_reply = false;
+
+	rc.msgs.clear();
+	rc.msgs.push_back("{\"cmd\":\"stop\",\"id\":\"not-there\"}");
+	run_bench("process_json_request/stop_unknown", do_request, &rc);
+
+	rc.msgs.clear();
+	rc.msgs.push_back("{\"cmd\":\"add_text\",\"id\":\"ticker\",\"x\":0,");
+	run_bench("process_json_request/parse_error", do_request, &rc);
+
+	// the same commands in the binary encoding
+	rc.msgs.clear();
+	rc.msgs.push_back(binary_add_text("12:00 Departure platform 3"));
+	rc.msgs.push_back(binary_add_text("12:01 Departure platform 4"));
+	run_bench("process_binary_command/add_text_replace", do_binary_request, &rc);
+
+	uint8_t buffer[64];
+	size_t n = binary_encode_header(buffer, BC_BRIGHTNESS, 0, 0);
+	buffer[n++] = 40;
+
+	rc.msgs.clear();
+	rc.msgs.push_back(std::string((const char *)buffer, n));
+	run_bench("process_binary_command/brightness", do_binary_request, &rc);
+
+	rc.msgs.clear();
+	rc.msgs.push_back(std::string((const char *)buffer, binary_encode_stop(buffer, 0, 0, "not-there")));
+	run_bench("process_binary_command/stop_unknown", do_binary_request, &rc);
+
+	uninit_server(&sc);
+}
+
+// how drawBuffer() did it before: per pixel scaling against the brightness
+static void push_per_pixel(rgb_matrix::Canvas *const c, const uint8_t *const data, const int w, const int h, const int brightness)
+{
+	for(int y=0; y<h; y++) {
+		for(int x=0; x<w; x++) {
+			int o = y * w * 3 + x * 3;
+
+			c->SetPixel(x, y, (data[o + 0] * brightness) / 100, (data[o + 1] * brightness) / 100, (data[o + 2] * brightness) / 100);
+		}
+	}
+}
+
+typedef struct {
+	memory_canvas *c;
+	frame_pusher *fp;
+	uint8_t *frames[2];
+	int w, h;
+	rect_t r;
+} push_ctx_t;
+
+static void do_push_per_pixel(void *const ctx, const int i)
+{
+	push_ctx_t *const pc = (push_ctx_t *)ctx;
+
+	push_per_pixel(pc -> c, pc -> frames[i & 1], pc -> w, pc -> h, 50);
+}
+
+static void do_push_lut(void *const ctx, const int i)
+{
+	push_ctx_t *const pc = (push_ctx_t *)ctx;
+
+	pc -> fp -> push(pc -> c, pc -> frames[i & 1], pc -> r);
+}
+
+static void do_push_lut_ticker(void *const ctx, const int i)
+{
+	push_ctx_t *const pc = (push_ctx_t *)ctx;
+
+	pc -> frames[0][(pc -> r.y * pc -> w + i % pc -> r.w) * 3] ^= 0xff;
+
+	pc -> fp -> push(pc -> c, pc -> frames[0], pc -> r);
+}
+
+static void bench_draw_buffer(const int w, const int h)
+{
+	memory_canvas c(w, h);
+	frame_pusher fp(w, h, 50);
+
+	push_ctx_t pc;
+	pc.c = &c;
+	pc.fp = &fp;
+	pc.w = w;
+	pc.h = h;
+
+	// two frames that differ everywhere, alternated
+	for(int f=0; f<2; f++) {
+		pc.frames[f] = new uint8_t[w * h * 3];
+
+		for(int i=0; i<w * h * 3; i++)
+			pc.frames[f][i] = rand();
+	}
+
+	pc.r = rect_t { 0, 0, w, h };
+	run_bench(format("draw_buffer/per_pixel/%dx%d", w, h), do_push_per_pixel, &pc);
+	run_bench(format("draw_buffer/lut_full/%dx%d", w, h), do_push_lut, &pc);
+
+	// a 64x16 ticker that moved, the rest of the frame stayed the same
+	pc.r = rect_t { 0, 0, std::min(64, w), std::min(16, h) };
+	memcpy(pc.frames[1], pc.frames[0], w * h * 3);
+	run_bench(format("draw_buffer/lut_one_ticker/%dx%d", w, h), do_push_lut_ticker, &pc);
+
+	delete [] pc.frames[1];
+	delete [] pc.frames[0];
+}
+
+int main(int argc, char *argv[])
+{
+	std::string font_file = DEFAULT_FONT_FILE;
+
+	int c = -1;
+	while((c = getopt(argc, argv, "F:t:h")) != -1)
+	{
+		switch(c)
+		{
+			case 'F':
+				font_file = optarg;
+				break;
+
+			case 't':
+				min_run_ns = atoi(optarg) * 1000000ll;
+				break;
+
+			default:
+				printf("-F <font>      : Font file to render with. Default: %s\n", DEFAULT_FONT_FILE);
+				printf("-t <ms>        : Minimum run time per benchmark. Default: %d\n", int(min_run_ns / 1000000));
+				return c == 'h' ? 0 : 1;
+		}
+	}
+
+	// the code under test logs a lot; only the results go to stdout
+	out = fdopen(dup(1), "w");
+	err = fdopen(dup(2), "w");
+	setvbuf(err, NULL, _IONBF, 0);
+
+	int null_fd = open("/dev/null", O_WRONLY);
+	dup2(null_fd, 1);
+	dup2(null_fd, 2);
+	close(null_fd);
+
+	srand(1);
+
+	font::init_fonts();
+
+	results = json_array();
+
+	try
+	{
+		bench_font_render(font_file);
+		bench_font_render_threads(font_file);
+		bench_bitblit(192, 64);
+		bench_compose(font_file, 192, 64);
+		bench_compose_threads(font_file, 256, 64, 48);
+		bench_request(font_file, 192, 64);
+		bench_draw_buffer(32, 32);
+		bench_draw_buffer(64 * 4, 32);
+		bench_draw_buffer(192, 64);
+	}
+	catch(const std::string & e)
+	{
+		fprintf(err, "benchmark failed: %s\n", e.c_str());
+
+		return 1;
+	}
+
+	json_t *root = json_object();
+	json_object_set_new(root, "benchmarks", results);
+
+	char *str = json_dumps(root, JSON_INDENT(2) | JSON_PRESERVE_ORDER);
+	fprintf(out, "%s\n", str);
+	free(str);
+
+	json_decref(root);
+
+	font::uninit_fonts();
+
+	fclose(out);
+
+	return 0;
+}
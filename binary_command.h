@@ -0,0 +1,136 @@
+#ifndef __BINARY_COMMAND_H__
+#define __BINARY_COMMAND_H__
+
+// a compact encoding of add_text, stop, stop-all and brightness, sent as a
+// datagram (or length prefixed over tcp) to the command port instead of
+// json; all fields are big-endian. include this file in a sender
+#include <arpa/inet.h>
+#include <stdint.h>
+#include <string.h>
+
+#define BINARY_COMMAND_MAGIC 0x4d534243 // "MSBC"
+#define BINARY_COMMAND_VERSION 1
+
+typedef enum {
+	BC_ADD_TEXT = 1,
+	BC_STOP = 2,
+	BC_STOP_ALL = 3,
+	BC_BRIGHTNESS = 4,
+	// only sent by the server, as the reply to a command with BCF_ACK
+	BC_ACK = 0x80
+} binary_cmd_t;
+
+// header flags
+#define BCF_ACK 0x0001 // answer with a BC_ACK header (flags: BCF_OK when it worked)
+#define BCF_OK  0x0002
+
+typedef struct {
+	uint32_t magic;
+	uint8_t version;
+	uint8_t cmd; // binary_cmd_t
+	uint16_t flags;
+	uint32_t seq; // returned in the ack
+} __attribute__((packed)) binary_command_header_t;
+
+// add_text flags
+#define BTF_PRIO        0x01
+#define BTF_REPEAT_WRAP 0x02
+#define BTF_MOVE_LEFT   0x04
+#define BTF_ANTIALIAS   0x08
+#define BTF_TRANSPARENT 0x10 // transparent_rgb is used
+
+// BC_ADD_TEXT: follows the header, then id_len bytes of id, font_len bytes
+// of font name (0: the default font) and text_len bytes of text; the fields
+// have the meaning of those with the same name in the json add_text
+typedef struct {
+	int16_t x, y;
+	uint16_t w, h;
+	uint16_t pps;
+	uint8_t z_depth;
+	uint8_t flags; // BTF_...
+	int8_t alpha; // -1 when not used
+	uint8_t transparent_rgb[3];
+	uint32_t duration_ms; // 0 for forever
+	uint32_t trace; // 0 for not traced
+	uint8_t id_len, font_len;
+	uint16_t text_len;
+} __attribute__((packed)) binary_add_text_t;
+
+// BC_STOP: follows the header, then id_len bytes of id
+typedef struct {
+	uint8_t id_len;
+} __attribute__((packed)) binary_stop_t;
+
+// BC_BRIGHTNESS: follows the header
+typedef struct {
+	uint8_t brightness; // 1...100
+} __attribute__((packed)) binary_brightness_t;
+
+// sender: writes a header to out, returns its size
+inline size_t binary_encode_header(uint8_t *const out, const uint8_t cmd, const uint16_t flags, const uint32_t seq)
+{
+	binary_command_header_t bch;
+	bch.magic = htonl(BINARY_COMMAND_MAGIC);
+	bch.version = BINARY_COMMAND_VERSION;
+	bch.cmd = cmd;
+	bch.flags = htons(flags);
+	bch.seq = htonl(seq);
+
+	memcpy(out, &bch, sizeof bch);
+
+	return sizeof bch;
+}
+
+// sender: writes a complete BC_ADD_TEXT to out, which needs room for both
+// headers and the strings; bat is in host byte order and its lengths are
+// filled in here. returns the size
+inline size_t binary_encode_add_text(uint8_t *const out, const uint16_t flags, const uint32_t seq, binary_add_text_t bat, const char *const id, const char *const font_name, const char *const text)
+{
+	size_t n = binary_encode_header(out, BC_ADD_TEXT, flags, seq);
+
+	const size_t id_len = strlen(id), font_len = font_name ? strlen(font_name) : 0, text_len = strlen(text);
+
+	bat.x = htons(bat.x);
+	bat.y = htons(bat.y);
+	bat.w = htons(bat.w);
+	bat.h = htons(bat.h);
+	bat.pps = htons(bat.pps);
+	bat.duration_ms = htonl(bat.duration_ms);
+	bat.trace = htonl(bat.trace);
+	bat.id_len = id_len;
+	bat.font_len = font_len;
+	bat.text_len = htons(text_len);
+
+	memcpy(out + n, &bat, sizeof bat);
+	n += sizeof bat;
+
+	memcpy(out + n, id, id_len);
+	n += id_len;
+
+	if (font_len)
+		memcpy(out + n, font_name, font_len);
+	n += font_len;
+
+	memcpy(out + n, text, text_len);
+	n += text_len;
+
+	return n;
+}
+
+// sender: writes a complete BC_STOP to out, returns the size
+inline size_t binary_encode_stop(uint8_t *const out, const uint16_t flags, const uint32_t seq, const char *const id)
+{
+	size_t n = binary_encode_header(out, BC_STOP, flags, seq);
+
+	binary_stop_t bs;
+	bs.id_len = strlen(id);
+
+	memcpy(out + n, &bs, sizeof bs);
+	n += sizeof bs;
+
+	memcpy(out + n, id, bs.id_len);
+
+	return n + bs.id_len;
+}
+
+#endif
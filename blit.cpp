@@ -0,0 +1,305 @@
+#include <algorithm>
+#include <string.h>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define BLIT_NEON
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define BLIT_SSE2
+#endif
+
+#include "blit.h"
+#include "utils.h"
+
+// x / 100 for 0 <= x <= 25500 is (x * 5243) >> 19
+#define DIV100_MUL 5243
+
+static inline uint32_t load_pixel(const uint8_t *const p)
+{
+	return (p[0] << 16) | (p[1] << 8) | p[2];
+}
+
+// scalar versions, also used for the pixels left over by the vector kernels
+template <blit_mode_t mode>
+static inline void blit_row_scalar(uint8_t *const target, const uint8_t *const source, const int n, const blit_op_t *const op)
+{
+	if (mode == BM_OPAQUE)
+	{
+		memcpy(target, source, n * 3);
+		return;
+	}
+
+	const int alpha = op -> alpha, inv_alpha = 100 - alpha;
+
+	for(int x=0; x<n; x++)
+	{
+		const uint8_t *const s = &source[x * 3];
+		uint8_t *const t = &target[x * 3];
+
+		if ((mode == BM_COLOR_KEY || mode == BM_COLOR_KEY_ALPHA) && load_pixel(s) == op -> key)
+			continue;
+
+		if (mode == BM_ALPHA || mode == BM_COLOR_KEY_ALPHA)
+		{
+			t[0] = (s[0] * alpha + t[0] * inv_alpha) / 100;
+			t[1] = (s[1] * alpha + t[1] * inv_alpha) / 100;
+			t[2] = (s[2] * alpha + t[2] * inv_alpha) / 100;
+		}
+		else
+		{
+			t[0] = s[0];
+			t[1] = s[1];
+			t[2] = s[2];
+		}
+	}
+}
+
+#if defined(BLIT_SSE2)
+// 16 bytes blended, channel by channel
+static inline __m128i blend16(const __m128i s, const __m128i t, const __m128i va, const __m128i vinv_a)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i div = _mm_set1_epi16(DIV100_MUL);
+
+	__m128i lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(s, zero), va), _mm_mullo_epi16(_mm_unpacklo_epi8(t, zero), vinv_a));
+	__m128i hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(s, zero), va), _mm_mullo_epi16(_mm_unpackhi_epi8(t, zero), vinv_a));
+
+	lo = _mm_srli_epi16(_mm_mulhi_epu16(lo, div), 3);
+	hi = _mm_srli_epi16(_mm_mulhi_epu16(hi, div), 3);
+
+	return _mm_packus_epi16(lo, hi);
+}
+
+// for 16 pixels in 3 vectors: 0xff in each byte of a pixel that equals the key
+static inline void key_masks(const uint8_t *const s, const blit_op_t *const op, __m128i *const m0, __m128i *const m1, __m128i *const m2)
+{
+	// bytes at which a pixel starts, per vector
+	static const uint8_t start_bytes[48] = {
+		0xff, 0, 0, 0xff, 0, 0, 0xff, 0, 0, 0xff, 0, 0, 0xff, 0, 0, 0xff,
+		0, 0, 0xff, 0, 0, 0xff, 0, 0, 0xff, 0, 0, 0xff, 0, 0, 0xff, 0,
+		0, 0xff, 0, 0, 0xff, 0, 0, 0xff, 0, 0, 0xff, 0, 0, 0xff, 0, 0 };
+
+	const __m128i e0 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)&s[0]), _mm_loadu_si128((const __m128i *)&op -> key_pattern[0]));
+	const __m128i e1 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)&s[16]), _mm_loadu_si128((const __m128i *)&op -> key_pattern[16]));
+	const __m128i e2 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)&s[32]), _mm_loadu_si128((const __m128i *)&op -> key_pattern[32]));
+
+	// combine the 3 bytes of each pixel into its first byte...
+	__m128i a0 = _mm_and_si128(e0, _mm_and_si128(_mm_or_si128(_mm_srli_si128(e0, 1), _mm_slli_si128(e1, 15)), _mm_or_si128(_mm_srli_si128(e0, 2), _mm_slli_si128(e1, 14))));
+	__m128i a1 = _mm_and_si128(e1, _mm_and_si128(_mm_or_si128(_mm_srli_si128(e1, 1), _mm_slli_si128(e2, 15)), _mm_or_si128(_mm_srli_si128(e1, 2), _mm_slli_si128(e2, 14))));
+	__m128i a2 = _mm_and_si128(e2, _mm_and_si128(_mm_srli_si128(e2, 1), _mm_srli_si128(e2, 2)));
+
+	a0 = _mm_and_si128(a0, _mm_loadu_si128((const __m128i *)&start_bytes[0]));
+	a1 = _mm_and_si128(a1, _mm_loadu_si128((const __m128i *)&start_bytes[16]));
+	a2 = _mm_and_si128(a2, _mm_loadu_si128((const __m128i *)&start_bytes[32]));
+
+	// ...and spread it over all 3 again
+	*m0 = _mm_or_si128(a0, _mm_or_si128(_mm_slli_si128(a0, 1), _mm_slli_si128(a0, 2)));
+	*m1 = _mm_or_si128(_mm_or_si128(a1, _mm_or_si128(_mm_slli_si128(a1, 1), _mm_slli_si128(a1, 2))), _mm_or_si128(_mm_srli_si128(a0, 15), _mm_srli_si128(a0, 14)));
+	*m2 = _mm_or_si128(_mm_or_si128(a2, _mm_or_si128(_mm_slli_si128(a2, 1), _mm_slli_si128(a2, 2))), _mm_or_si128(_mm_srli_si128(a1, 15), _mm_srli_si128(a1, 14)));
+}
+
+template <blit_mode_t mode>
+static void blit_row(uint8_t *const target, const uint8_t *const source, const int n, const blit_op_t *const op)
+{
+	if (mode == BM_OPAQUE)
+	{
+		memcpy(target, source, n * 3);
+		return;
+	}
+
+	const __m128i va = _mm_set1_epi16(op -> alpha);
+	const __m128i vinv_a = _mm_set1_epi16(100 - op -> alpha);
+
+	int x = 0;
+
+	if (mode == BM_ALPHA)
+	{
+		// all bytes are treated the same, pixel boundaries do not matter
+		const int n_bytes = n * 3;
+		int o = 0;
+
+		for(; o + 16 <= n_bytes; o += 16)
+		{
+			__m128i s = _mm_loadu_si128((const __m128i *)&source[o]);
+			__m128i t = _mm_loadu_si128((const __m128i *)&target[o]);
+
+			_mm_storeu_si128((__m128i *)&target[o], blend16(s, t, va, vinv_a));
+		}
+
+		x = o / 3;
+
+		// the last (partial) pixel may already have been blended
+		if (o % 3)
+		{
+			const int done = o % 3;
+			uint8_t *const t = &target[x * 3 + done];
+			const uint8_t *const s = &source[x * 3 + done];
+
+			for(int i=0; i<3 - done; i++)
+				t[i] = (s[i] * op -> alpha + t[i] * (100 - op -> alpha)) / 100;
+
+			x++;
+		}
+	}
+	else
+	{
+		for(; x + 16 <= n; x += 16)
+		{
+			const uint8_t *const s = &source[x * 3];
+			uint8_t *const t = &target[x * 3];
+
+			__m128i m[3];
+			key_masks(s, op, &m[0], &m[1], &m[2]);
+
+			for(int i=0; i<3; i++)
+			{
+				__m128i vs = _mm_loadu_si128((const __m128i *)&s[i * 16]);
+				__m128i vt = _mm_loadu_si128((const __m128i *)&t[i * 16]);
+
+				if (mode == BM_COLOR_KEY_ALPHA)
+					vs = blend16(vs, vt, va, vinv_a);
+
+				// keep the target where the source has the key color
+				_mm_storeu_si128((__m128i *)&t[i * 16], _mm_or_si128(_mm_and_si128(m[i], vt), _mm_andnot_si128(m[i], vs)));
+			}
+		}
+	}
+
+	blit_row_scalar<mode>(&target[x * 3], &source[x * 3], n - x, op);
+}
+#elif defined(BLIT_NEON)
+// 16 bytes blended, channel by channel
+static inline uint8x16_t blend16(const uint8x16_t s, const uint8x16_t t, const uint8x8_t va, const uint8x8_t vinv_a)
+{
+	const int16x8_t div = vdupq_n_s16(DIV100_MUL);
+
+	uint16x8_t lo = vmlal_u8(vmull_u8(vget_low_u8(s), va), vget_low_u8(t), vinv_a);
+	uint16x8_t hi = vmlal_u8(vmull_u8(vget_high_u8(s), va), vget_high_u8(t), vinv_a);
+
+	// (2 * x * 5243) >> 16 >> 4 == x / 100, no saturation as x <= 25500
+	lo = vshrq_n_u16(vreinterpretq_u16_s16(vqdmulhq_s16(vreinterpretq_s16_u16(lo), div)), 4);
+	hi = vshrq_n_u16(vreinterpretq_u16_s16(vqdmulhq_s16(vreinterpretq_s16_u16(hi), div)), 4);
+
+	return vcombine_u8(vmovn_u16(lo), vmovn_u16(hi));
+}
+
+template <blit_mode_t mode>
+static void blit_row(uint8_t *const target, const uint8_t *const source, const int n, const blit_op_t *const op)
+{
+	if (mode == BM_OPAQUE)
+	{
+		memcpy(target, source, n * 3);
+		return;
+	}
+
+	const uint8x8_t va = vdup_n_u8(op -> alpha);
+	const uint8x8_t vinv_a = vdup_n_u8(100 - op -> alpha);
+	const uint8x16_t key_r = vdupq_n_u8(op -> key >> 16);
+	const uint8x16_t key_g = vdupq_n_u8(op -> key >> 8);
+	const uint8x16_t key_b = vdupq_n_u8(op -> key);
+
+	int x = 0;
+
+	// vld3 splits 16 pixels in a vector per channel
+	for(; x + 16 <= n; x += 16)
+	{
+		const uint8x16x3_t s = vld3q_u8(&source[x * 3]);
+		const uint8x16x3_t t = vld3q_u8(&target[x * 3]);
+		uint8x16x3_t out;
+
+		for(int i=0; i<3; i++)
+		{
+			if (mode == BM_ALPHA || mode == BM_COLOR_KEY_ALPHA)
+				out.val[i] = blend16(s.val[i], t.val[i], va, vinv_a);
+			else
+				out.val[i] = s.val[i];
+		}
+
+		if (mode == BM_COLOR_KEY || mode == BM_COLOR_KEY_ALPHA)
+		{
+			const uint8x16_t m = vandq_u8(vandq_u8(vceqq_u8(s.val[0], key_r), vceqq_u8(s.val[1], key_g)), vceqq_u8(s.val[2], key_b));
+
+			for(int i=0; i<3; i++)
+				out.val[i] = vbslq_u8(m, t.val[i], out.val[i]);
+		}
+
+		vst3q_u8(&target[x * 3], out);
+	}
+
+	blit_row_scalar<mode>(&target[x * 3], &source[x * 3], n - x, op);
+}
+#else
+template <blit_mode_t mode>
+static void blit_row(uint8_t *const target, const uint8_t *const source, const int n, const blit_op_t *const op)
+{
+	blit_row_scalar<mode>(target, source, n, op);
+}
+#endif
+
+const blit_op_t blit_opaque = { BM_OPAQUE, 0, { 0 }, 100, blit_row<BM_OPAQUE> };
+
+void init_blit_op(blit_op_t *const op, const std::string & transparent_color, const int alpha)
+{
+	const bool use_key = !transparent_color.empty();
+
+	uint8_t r = 0, g = 0, b = 0;
+	if (use_key)
+		hex_str_to_rgb(transparent_color, &r, &g, &b);
+
+	init_blit_op_rgb(op, use_key, r, g, b, alpha);
+}
+
+void init_blit_op_rgb(blit_op_t *const op, const bool use_key, const uint8_t r, const uint8_t g, const uint8_t b, const int alpha)
+{
+	const bool use_alpha = alpha >= 0;
+
+	op -> key = (r << 16) | (g << 8) | b;
+
+	for(int i=0; i<48; i += 3)
+	{
+		op -> key_pattern[i + 0] = r;
+		op -> key_pattern[i + 1] = g;
+		op -> key_pattern[i + 2] = b;
+	}
+
+	op -> alpha = std::min(100, std::max(0, alpha));
+
+	if (use_key && use_alpha)
+	{
+		op -> mode = BM_COLOR_KEY_ALPHA;
+		op -> row = blit_row<BM_COLOR_KEY_ALPHA>;
+	}
+	else if (use_key)
+	{
+		op -> mode = BM_COLOR_KEY;
+		op -> row = blit_row<BM_COLOR_KEY>;
+	}
+	else if (use_alpha)
+	{
+		op -> mode = BM_ALPHA;
+		op -> row = blit_row<BM_ALPHA>;
+	}
+	else
+	{
+		op -> mode = BM_OPAQUE;
+		op -> row = blit_row<BM_OPAQUE>;
+	}
+}
+
+void bitblit(uint8_t *const target, const int tw, const int th, const int tx, const int ty, const uint8_t *const source, const int sw, const int sh, const int sx, const int sy, const int scw, const int sch, const blit_op_t *const op)
+{
+	int source_space_x = std::max(0, sw - sx);
+	int source_space_y = std::max(0, sh - sy);
+	int target_space_x = std::max(0, tw - tx);
+	int target_space_y = std::max(0, th - ty);
+	int copy_w = std::min(std::min(std::min(tw, scw), source_space_x), target_space_x);
+	int copy_h = std::min(std::min(std::min(th, sch), source_space_y), target_space_y);
+
+	if (copy_w <= 0)
+		return;
+
+	// printf("copy %dx%d pixels to %d,%d from %d,%d\n", copy_w, copy_h, tx, ty, sx, sy);
+	for(int y=0; y<copy_h; y++)
+		op -> row(&target[(tx + (ty + y) * tw) * 3], &source[(sx + (sy + y) * sw) * 3], copy_w, op);
+}
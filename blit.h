@@ -0,0 +1,31 @@
+#ifndef __BLIT_H__
+#define __BLIT_H__
+
+#include <stdint.h>
+#include <string>
+
+typedef enum { BM_OPAQUE, BM_COLOR_KEY, BM_ALPHA, BM_COLOR_KEY_ALPHA } blit_mode_t;
+
+struct blit_op_s;
+
+// copies n pixels (RGB, 3 bytes each) from source to target
+typedef void (*blit_row_t)(uint8_t *const target, const uint8_t *const source, const int n, const struct blit_op_s *const op);
+
+// how an element is copied, determined once when it is created
+typedef struct blit_op_s {
+	blit_mode_t mode;
+	uint32_t key; // transparent color, packed as 0xrrggbb
+	uint8_t key_pattern[48]; // the key repeated for 16 pixels, for the vector kernels
+	int alpha; // 0...100, weight of the source
+	blit_row_t row;
+} blit_op_t;
+
+extern const blit_op_t blit_opaque;
+
+void init_blit_op(blit_op_t *const op, const std::string & transparent_color, const int alpha);
+// the same with the transparent color already parsed
+void init_blit_op_rgb(blit_op_t *const op, const bool use_key, const uint8_t r, const uint8_t g, const uint8_t b, const int alpha);
+
+void bitblit(uint8_t *const target, const int tw, const int th, const int tx, const int ty, const uint8_t *const source, const int sw, const int sh, const int sx, const int sy, const int scw, const int sch, const blit_op_t *const op);
+
+#endif
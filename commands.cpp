@@ -0,0 +1,1502 @@
+#include <algorithm>
+#include <arpa/inet.h>
+#include <atomic>
+#include <jansson.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <string.h>
+#include <vector>
+
+#include "asset_cache.h"
+#include "binary_command.h"
+#include "commands.h"
+#include "font.h"
+#include "frame_pacer.h"
+#include "log.h"
+#include "pool.h"
+#include "stats.h"
+#include "stream.h"
+#include "trace.h"
+#include "utils.h"
+
+std::atomic_bool global_terminate;
+
+// elements and the fonts that hold their rendered texts are replaced all
+// the time: recycle them instead of going to the heap each time
+static object_pool<disp_element_t> element_pool;
+static object_pool<font> font_pool;
+
+// what an add_* command asks for, the same for json and binary commands;
+// the strings point into the command
+typedef struct {
+	const char *id;
+	size_t id_len;
+	int x, y, w, h, duration_ms, z_depth;
+	bool prio;
+	bool use_key;
+	uint8_t key_r, key_g, key_b;
+	int alpha;
+} element_params_t;
+
+typedef struct {
+	const char *text, *font_name; // font_name: NULL for the default font
+	size_t text_len, font_name_len;
+	int pps;
+	bool repeat_wrap, move_left, antialias;
+	uint32_t trace;
+} text_params_t;
+
+// which frame of the animation of an image element is shown t us after its start
+static int sprite_frame_at(const disp_element_t *const de, const int64_t t)
+{
+	const int64_t pos = t % de -> sprite.back().end_us;
+
+	size_t i = 0;
+	while(de -> sprite.at(i).end_us <= pos)
+		i++;
+
+	return i;
+}
+
+// moves and animates an image element, returns when it wants to be called again
+static int64_t step_image(disp_element_t *const de, const int64_t now)
+{
+	const int64_t t = now - de -> start_ts - de -> paused_us;
+	int64_t next = now + IMAGE_POLL_US;
+
+	if (!de -> pause)
+	{
+		bool changed = false;
+
+		if (de -> us_per_pps)
+		{
+			const int64_t pixels = t / de -> us_per_pps;
+
+			changed |= de -> scroll_pixels.exchange(pixels) != pixels;
+
+			// stay on the pps-grid, as texts do
+			next = std::min(next, now + de -> us_per_pps - ((now - de -> start_ts) % de -> us_per_pps));
+		}
+
+		if (de -> sprite.size() > 1)
+		{
+			const int f = sprite_frame_at(de, t);
+
+			changed |= de -> sprite_frame.exchange(f) != f;
+
+			// when this frame is over
+			next = std::min(next, now + de -> sprite.at(f).end_us - t % de -> sprite.back().end_us);
+		}
+
+		if (changed)
+			de -> dirty -> add(de -> x, de -> y, de -> w, de -> h);
+	}
+
+	const int64_t end_ts = de -> end_ts;
+
+	if (end_ts != 0)
+		next = std::min(next, end_ts);
+
+	return next;
+}
+
+// called by the scheduler each time the element should scroll one pixel
+int64_t step_display_element(disp_element_t *const de, const int64_t now)
+{
+	const int64_t end_ts = de -> end_ts;
+
+	if (de -> terminate || (end_ts != 0 && now >= end_ts))
+	{
+		// text changes when it is replaced in place
+		pthread_mutex_lock(&de -> producer_lock);
+		log_msg(LL_INFO, "scroller for \"%s\" terminating", de -> text.c_str());
+		pthread_mutex_unlock(&de -> producer_lock);
+
+		de -> owner -> terminate(de);
+
+		de -> dirty -> add(de -> x, de -> y, de -> w, de -> h);
+
+		return -1;
+	}
+
+	if (de -> kind == EK_STREAM)
+	{
+		// a new frame: the element must be redrawn
+		const uint32_t nr = de -> stream -> latest();
+
+		if (!de -> pause && nr != de -> stream_seen)
+		{
+			de -> stream_seen = nr;
+
+			de -> dirty -> add(de -> x, de -> y, de -> w, de -> h);
+		}
+
+		return now + STREAM_POLL_US;
+	}
+
+	if (de -> pause)
+		de -> paused_us += now - de -> last_tick_ts;
+
+	de -> last_tick_ts = now;
+
+	if (de -> kind == EK_IMAGE)
+		return step_image(de, now);
+
+	if (!de -> pause)
+	{
+		// derived from the time instead of counted, so a late tick does not slow it down
+		int64_t pixels = (now - de -> start_ts - de -> paused_us) / de -> us_per_pps;
+
+		if (de -> scroll_pixels.exchange(pixels) != pixels)
+			de -> dirty -> add(de -> x, de -> y, de -> w, de -> h);
+	}
+
+	// stay on the pps-grid that started when the element was added
+	return now + de -> us_per_pps - ((now - de -> start_ts) % de -> us_per_pps);
+}
+
+void pause_all_but(pthread_rwlock_t *const clients_lock, scene *const clients, const std::string & skip, const bool pause)
+{
+	pthread_rwlock_rdlock(clients_lock); // readlock: not changing the map, only the data of the map
+
+	scene::iterator it = clients -> begin();
+	for(; it != clients -> end(); it++)
+	{
+		if (it -> first != skip)
+			clients -> pause(it -> second, pause);
+	}
+
+	pthread_rwlock_unlock(clients_lock);
+}
+
+void delete_element(disp_element_t *const de)
+{
+	for(int i=0; i<3; i++)
+		font_pool.put(de -> frames.get_slot(i).f);
+
+	delete de -> stream;
+
+	pthread_mutex_destroy(&de -> producer_lock);
+
+	element_pool.put(de);
+}
+
+// can a new text for the same id be swapped into the existing element?
+bool same_layout(const disp_element_t *const a, const disp_element_t *const b)
+{
+	return a -> kind == EK_TEXT && b -> kind == EK_TEXT &&
+		a -> x == b -> x && a -> y == b -> y && a -> w == b -> w && a -> h == b -> h &&
+		a -> pps == b -> pps && a -> z_depth == b -> z_depth && a -> prio == b -> prio &&
+		a -> repeat_wrap == b -> repeat_wrap && a -> move_left == b -> move_left &&
+		a -> blit_op.mode == b -> blit_op.mode && a -> blit_op.key == b -> blit_op.key && a -> blit_op.alpha == b -> blit_op.alpha;
+}
+
+// publish the text of new_de in de; the producer_lock only keeps producers apart
+void replace_text(disp_element_t *const de, disp_element_t *const new_de)
+{
+	pthread_mutex_lock(&de -> producer_lock);
+
+	text_frame_t & back = de -> frames.get_back();
+
+	// the back slot is never the one the compositor is reading from
+	font_pool.put(back.f);
+	back = new_de -> frames.get_back();
+	new_de -> frames.get_back().f = NULL;
+
+	de -> frames.publish();
+
+	de -> end_ts = new_de -> end_ts.load();
+
+	de -> text.swap(new_de -> text);
+
+	pthread_mutex_unlock(&de -> producer_lock);
+
+	de -> dirty -> add(de -> x, de -> y, de -> w, de -> h);
+}
+
+// remove the elements the scheduler is done with
+bool purge_elements(pthread_rwlock_t *const clients_lock, scene *const clients)
+{
+	bool hits = false;
+
+	pthread_rwlock_wrlock(clients_lock);
+
+	scene::iterator it = clients -> begin();
+	for(; it != clients -> end();)
+	{
+		if (it -> second -> finished == false) {
+			it++;
+			continue;
+		}
+
+		disp_element_t *const de = it -> second;
+
+		clients -> erase(it++);
+
+		delete_element(de);
+
+		hits = true;
+	}
+
+	pthread_rwlock_unlock(clients_lock);
+
+	return hits;
+}
+
+void terminate_elements(scheduler *const s, pthread_rwlock_t *const clients_lock, scene *const clients)
+{
+	pthread_rwlock_rdlock(clients_lock);
+
+	scene::iterator it = clients -> begin();
+	for(; it != clients -> end(); it++)
+		clients -> terminate(it -> second);
+
+	pthread_rwlock_unlock(clients_lock);
+
+	// after this, all elements are marked as finished
+	s -> stop();
+
+	purge_elements(clients_lock, clients); // clean-up
+}
+
+static json_t *pool_stats_json(const pool_stats_t & ps)
+{
+	json_t *pool = json_object();
+	json_object_set_new(pool, "in_use", json_integer(ps.in_use));
+	json_object_set_new(pool, "high_water", json_integer(ps.high_water));
+	json_object_set_new(pool, "capacity", json_integer(ps.capacity));
+	json_object_set_new(pool, "gets", json_integer(ps.gets));
+	json_object_set_new(pool, "heap_allocs", json_integer(ps.heap_allocs));
+
+	return pool;
+}
+
+std::string get_stats_json(double_buffer_t *const db, pthread_rwlock_t *const clients_lock, scene *const clients)
+{
+	json_t *out = json_object();
+
+	frame_stats_t fs;
+	db -> pacer -> get_stats(&fs);
+
+	json_t *frames = json_object();
+	json_object_set_new(frames, "count", json_integer(fs.frames));
+	json_object_set_new(frames, "late", json_integer(fs.late));
+	json_object_set_new(frames, "dropped", json_integer(fs.dropped));
+	json_object_set_new(frames, "p50_us", json_integer(fs.p50_us));
+	json_object_set_new(frames, "p99_us", json_integer(fs.p99_us));
+	json_object_set_new(frames, "max_us", json_integer(fs.max_us));
+	json_object_set_new(frames, "target_us", json_integer(fs.target_us));
+	json_object_set_new(frames, "max_busy_us", json_integer(fs.max_busy_us));
+	json_object_set_new(out, "frames", frames);
+
+	stats_snapshot_t ss;
+	stats_get(&ss);
+
+	json_t *stages = json_object();
+	for(int i=0; i<N_STAGES; i++)
+	{
+		const stage_stats_t & st = ss.stages[i];
+
+		json_t *stage = json_object();
+		json_object_set_new(stage, "count", json_integer(st.n));
+		json_object_set_new(stage, "avg_us", json_real(st.avg_us));
+		json_object_set_new(stage, "recent_us", json_real(st.recent_us));
+		json_object_set_new(stage, "p50_us", json_real(st.p50_us));
+		json_object_set_new(stage, "p99_us", json_real(st.p99_us));
+		json_object_set_new(stage, "max_us", json_real(st.max_us));
+		json_object_set_new(stages, stats_stage_name(stage_t(i)), stage);
+	}
+	json_object_set_new(out, "stages", stages);
+
+	glyph_cache_stats_t gcs;
+	font::get_glyph_cache_stats(&gcs);
+
+	json_t *glyphs = json_object();
+	json_object_set_new(glyphs, "hits", json_integer(gcs.hits));
+	json_object_set_new(glyphs, "misses", json_integer(gcs.misses));
+	json_object_set_new(glyphs, "hit_rate", json_real(gcs.hits + gcs.misses ? double(gcs.hits) / (gcs.hits + gcs.misses) : 0));
+	json_object_set_new(glyphs, "evictions", json_integer(gcs.evictions));
+	json_object_set_new(glyphs, "glyphs", json_integer(gcs.n_glyphs));
+	json_object_set_new(glyphs, "bytes", json_integer(gcs.bytes));
+	json_object_set_new(glyphs, "max_bytes", json_integer(gcs.max_bytes));
+	json_object_set_new(out, "glyph_cache", glyphs);
+
+	const uint64_t face_hits = ss.counters[CNT_FACE_HITS], face_misses = ss.counters[CNT_FACE_MISSES];
+	const uint64_t name_hits = ss.counters[CNT_FONT_NAME_HITS], name_misses = ss.counters[CNT_FONT_NAME_MISSES];
+
+	json_t *fonts = json_object();
+	json_object_set_new(fonts, "face_hits", json_integer(face_hits));
+	json_object_set_new(fonts, "face_misses", json_integer(face_misses));
+	json_object_set_new(fonts, "face_hit_rate", json_real(face_hits + face_misses ? double(face_hits) / (face_hits + face_misses) : 0));
+	json_object_set_new(fonts, "name_hits", json_integer(name_hits));
+	json_object_set_new(fonts, "name_misses", json_integer(name_misses));
+	json_object_set_new(fonts, "name_hit_rate", json_real(name_hits + name_misses ? double(name_hits) / (name_hits + name_misses) : 0));
+	json_object_set_new(fonts, "freetype_contexts", json_integer(font::get_n_contexts()));
+	json_object_set_new(out, "font_cache", fonts);
+
+	if (db -> assets)
+	{
+		asset_cache_stats_t acs;
+		db -> assets -> get_stats(&acs);
+
+		json_t *assets = json_object();
+		json_object_set_new(assets, "hits", json_integer(acs.hits));
+		json_object_set_new(assets, "misses", json_integer(acs.misses));
+		json_object_set_new(assets, "evictions", json_integer(acs.evictions));
+		json_object_set_new(assets, "assets", json_integer(acs.n_assets));
+		json_object_set_new(assets, "bytes", json_integer(acs.bytes));
+		json_object_set_new(assets, "max_bytes", json_integer(acs.max_bytes));
+
+		json_t *list = json_array();
+
+		for(size_t i=0; i<acs.assets.size(); i++)
+		{
+			const asset_info_t & ai = acs.assets.at(i);
+
+			json_t *asset = json_object();
+			json_object_set_new(asset, "file", json_string(ai.path.c_str()));
+			json_object_set_new(asset, "hash", json_string(format("%016llx", (unsigned long long)ai.hash).c_str()));
+			json_object_set_new(asset, "w", json_integer(ai.w));
+			json_object_set_new(asset, "h", json_integer(ai.h));
+			json_object_set_new(asset, "images", json_integer(ai.n_images));
+			json_object_set_new(asset, "bytes", json_integer(ai.bytes));
+			json_object_set_new(asset, "users", json_integer(ai.users));
+			json_object_set_new(asset, "hits", json_integer(ai.hits));
+			json_array_append_new(list, asset);
+		}
+
+		json_object_set_new(assets, "list", list);
+		json_object_set_new(out, "asset_cache", assets);
+	}
+
+	pool_stats_t ps;
+	json_t *pools = json_object();
+
+	element_pool.get_stats(&ps);
+	json_object_set_new(pools, "elements", pool_stats_json(ps));
+
+	font_pool.get_stats(&ps);
+	json_object_set_new(pools, "texts", pool_stats_json(ps));
+
+	std::vector<buffer_class_stats_t> bcs;
+	size_t free_bytes = 0;
+	uint64_t oversized = 0;
+	pixel_buffers.get_stats(&bcs, &free_bytes, &oversized);
+
+	json_t *pixels = json_object();
+
+	for(size_t i=0; i<bcs.size(); i++)
+	{
+		json_t *pool = pool_stats_json(bcs.at(i).ps);
+		json_object_set_new(pool, "free", json_integer(bcs.at(i).n_free));
+		json_object_set_new(pixels, format("%zu", bcs.at(i).size).c_str(), pool);
+	}
+
+	json_object_set_new(pools, "pixel_buffers", pixels);
+	json_object_set_new(pools, "pixel_free_bytes", json_integer(free_bytes));
+	json_object_set_new(pools, "pixel_oversized", json_integer(oversized));
+	json_object_set_new(out, "pools", pools);
+
+	log_stats_t ls;
+	log_get_stats(&ls);
+
+	json_t *log = json_object();
+	json_object_set_new(log, "level", json_string(log_level_name(ls.level)));
+	json_object_set_new(log, "written", json_integer(ls.written));
+	json_object_set_new(log, "dropped", json_integer(ls.dropped));
+	json_object_set_new(log, "threads", json_integer(ls.threads));
+	json_object_set_new(out, "log", log);
+
+	json_object_set_new(out, "commands", json_integer(ss.counters[CNT_COMMANDS]));
+	json_object_set_new(out, "binary_commands", json_integer(ss.counters[CNT_BINARY_COMMANDS]));
+	json_object_set_new(out, "parse_failures", json_integer(ss.counters[CNT_PARSE_FAILURES]));
+
+	json_t *udp = json_object();
+	json_object_set_new(udp, "received", json_integer(ss.counters[CNT_UDP_RECEIVED]));
+	json_object_set_new(udp, "queue_full", json_integer(ss.counters[CNT_UDP_QUEUE_FULL]));
+	json_object_set_new(udp, "truncated", json_integer(ss.counters[CNT_UDP_TRUNCATED]));
+	json_object_set_new(udp, "kernel_drops", json_integer(ss.counters[CNT_UDP_KERNEL_DROPS]));
+	json_object_set_new(out, "udp", udp);
+
+	json_object_set_new(out, "stream_fragments", json_integer(ss.counters[CNT_STREAM_FRAGMENTS]));
+	json_object_set_new(out, "stream_fragments_rejected", json_integer(ss.counters[CNT_STREAM_REJECTED]));
+
+	json_t *streams = json_object();
+
+	// the rendered texts of all elements, in all three slots
+	size_t n_elements = 0, element_bytes = 0;
+
+	pthread_rwlock_rdlock(clients_lock);
+
+	scene::iterator it = clients -> begin();
+	for(;it != clients -> end(); it++)
+	{
+		disp_element_t *const de = it -> second;
+
+		if (!de -> terminate)
+			n_elements++;
+
+		if (de -> kind == EK_STREAM && !de -> terminate)
+		{
+			stream_stats_t sst;
+			de -> stream -> get_stats(&sst);
+
+			json_t *stream = json_object();
+			json_object_set_new(stream, "frames", json_integer(sst.frames));
+			json_object_set_new(stream, "dropped", json_integer(sst.dropped));
+			json_object_set_new(stream, "late", json_integer(sst.late));
+			json_object_set_new(stream, "torn", json_integer(sst.torn));
+			json_object_set_new(streams, it -> first.c_str(), stream);
+		}
+
+		pthread_mutex_lock(&de -> producer_lock);
+
+		for(int i=0; i<3; i++)
+		{
+			if (de -> frames.get_slot(i).f)
+				element_bytes += de -> frames.get_slot(i).w * de -> h * 3;
+		}
+
+		pthread_mutex_unlock(&de -> producer_lock);
+	}
+
+	pthread_rwlock_unlock(clients_lock);
+
+	json_object_set_new(out, "elements", json_integer(n_elements));
+	json_object_set_new(out, "element_bytes", json_integer(element_bytes));
+	json_object_set_new(out, "streams", streams);
+
+	char *str = json_dumps(out, JSON_COMPACT);
+	std::string result = str;
+	free(str);
+
+	json_decref(out);
+
+	return result;
+}
+
+// the traced commands that reached the display since the previous call,
+// each as [ trace, received_ns, composed_ns, pushed_ns ]
+std::string get_trace_json(double_buffer_t *const db)
+{
+	std::vector<trace_record_t> records;
+	const uint64_t dropped = db -> traces -> take(&records, MAX_TRACES_PER_REPLY);
+
+	json_t *out = json_object();
+	json_t *list = json_array();
+
+	for(size_t i=0; i<records.size(); i++)
+	{
+		const trace_record_t & tr = records.at(i);
+
+		json_t *entry = json_array();
+		json_array_append_new(entry, json_integer(tr.trace));
+		json_array_append_new(entry, json_integer(tr.received_ns));
+		json_array_append_new(entry, json_integer(tr.composed_ns));
+		json_array_append_new(entry, json_integer(tr.pushed_ns));
+		json_array_append_new(list, entry);
+	}
+
+	json_object_set_new(out, "traces", list);
+	json_object_set_new(out, "dropped", json_integer(dropped));
+
+	char *str = json_dumps(out, JSON_COMPACT);
+	std::string result = str;
+	free(str);
+
+	json_decref(out);
+
+	return result;
+}
+
+// a string in a json object, pointing into that object
+static const char *get_json_str_ptr(const json_t *const obj, const char *const key, const char *const default_value, size_t *const len)
+{
+	const json_t *const value = json_object_get(obj, key);
+	const char *str = json_is_string(value) ? json_string_value(value) : default_value;
+
+	*len = str ? strlen(str) : 0;
+
+	return str;
+}
+
+// the fields of an add_* command that all kinds of elements have
+void get_element_params(const json_t *const obj, double_buffer_t *const db, element_params_t *const ep)
+{
+	ep -> id = get_json_str_ptr(obj, "id", "", &ep -> id_len);
+	ep -> x = get_json_int(obj, "x", 0);
+	ep -> y = get_json_int(obj, "y", 0);
+	ep -> w = get_json_int(obj, "w", db -> w);
+	ep -> h = get_json_int(obj, "h", db -> h);
+	ep -> duration_ms = get_json_int(obj, "duration", 0);
+	ep -> z_depth = get_json_int(obj, "z_depth", 0);
+	ep -> prio = get_json_int(obj, "prio", 1) != 0;
+
+	std::string transparent_color = get_json_str(obj, "transparent_color", "");
+	if (transparent_color.empty())
+		transparent_color = get_json_str(obj, "transparency_color", "");
+
+	ep -> use_key = !transparent_color.empty();
+	ep -> key_r = ep -> key_g = ep -> key_b = 0;
+	if (ep -> use_key)
+		hex_str_to_rgb(transparent_color, &ep -> key_r, &ep -> key_g, &ep -> key_b);
+
+	ep -> alpha = get_json_int(obj, "alpha", -1);
+}
+
+disp_element_t *new_element(const element_params_t & ep, double_buffer_t *const db, std::string *const id)
+{
+	id -> assign(ep.id, ep.id_len);
+
+	if (id -> empty())
+	{
+		*id = format("%x%x", rand(), rand());
+		log_msg(LL_WARNING, "No id given, using %s", id -> c_str());
+	}
+
+	disp_element_t *de = element_pool.get();
+	de -> kind = EK_TEXT;
+	de -> x = ep.x;
+	check_range(&de -> x, 0, db -> w - 1);
+	de -> y = ep.y;
+	check_range(&de -> y, 0, db -> h * 2);
+	de -> w = ep.w;
+	check_range(&de -> w, 1, db -> w);
+	de -> h = ep.h;
+	check_range(&de -> h, 1, db -> h);
+	de -> pps = 1;
+	de -> duration = ep.duration_ms * 1000;
+	de -> end_ts = de -> duration ? get_mono_ns() / 1000 + de -> duration : 0;
+	de -> z_depth = ep.z_depth; // z-depth: 255 is front
+	check_range(&de -> z_depth, 0, 255);
+	de -> pause = 0;
+	de -> prio = ep.prio;
+	de -> repeat_wrap = de -> move_left = de -> antialias = false;
+	de -> terminate = de -> finished = false;
+	de -> owner = NULL;
+	de -> seq = 0;
+	de -> producer_lock = PTHREAD_MUTEX_INITIALIZER;
+	de -> dirty = db -> dirty;
+	de -> want_flash = &db -> want_flash;
+	init_blit_op_rgb(&de -> blit_op, ep.use_key, ep.key_r, ep.key_g, ep.key_b, ep.alpha);
+	de -> stream = NULL;
+	de -> stream_seen = 0;
+	de -> sprite_w = 0;
+	de -> sprite_frame = 0;
+	de -> scroll_pixels = 0;
+	de -> paused_us = 0;
+
+	return de;
+}
+
+disp_element_t *new_element(const json_t *const obj, double_buffer_t *const db, std::string *const id)
+{
+	element_params_t ep;
+	get_element_params(obj, db, &ep);
+
+	return new_element(ep, db, id);
+}
+
+// renders the text of an add_text command, NULL when that failed
+disp_element_t *create_text_element(const element_params_t & ep, const text_params_t & tp, const int64_t received_ns, double_buffer_t *const db, std::string *const id)
+{
+	disp_element_t *de = new_element(ep, db, id);
+	de -> text.assign(tp.text, tp.text_len);
+	de -> pps = tp.pps; // pixels per second
+	check_range(&de -> pps, 1, db -> w);
+	de -> repeat_wrap = tp.repeat_wrap;
+	de -> move_left = tp.move_left;
+	if (tp.font_name_len)
+		de -> font_name.assign(tp.font_name, tp.font_name_len);
+	else
+		de -> font_name = db -> font_name;
+	de -> default_font = db -> font_name;
+	de -> antialias = tp.antialias;
+
+	// render the text before any locks are taken: this is the slow part
+	bool flash_requested = false;
+	text_frame_t & tf = de -> frames.get_back();
+
+	try
+	{
+		stage_timer t(STAGE_FONT_RENDER);
+
+		std::string font_file = find_font_by_name(de -> font_name, de -> default_font);
+		tf.f = font_pool.get(font_file, de -> text, de -> h, de -> antialias);
+	}
+	catch(const std::string & e)
+	{
+		log_msg(LL_ERROR, "cannot render text for %s: %s", id -> c_str(), e.c_str());
+
+		delete_element(de);
+
+		return NULL;
+	}
+
+	tf.f -> getImage(&tf.w, &tf.img, &flash_requested);
+	tf.trace = tp.trace;
+	tf.received_ns = received_ns;
+
+	log_msg(LL_DEBUG, "text width after render: %d", tf.w);
+
+	if (flash_requested)
+		db -> want_flash = true;
+
+	return de;
+}
+
+// parses an add_text command and renders its text, NULL when that failed
+disp_element_t *create_text_element(const json_t *const obj, const int64_t received_ns, double_buffer_t *const db, std::string *const id)
+{
+	element_params_t ep;
+	get_element_params(obj, db, &ep);
+
+	text_params_t tp;
+	tp.text = get_json_str_ptr(obj, "text", "no text given", &tp.text_len);
+	tp.font_name = get_json_str_ptr(obj, "font_name", NULL, &tp.font_name_len);
+	tp.pps = get_json_int(obj, "pps", 10);
+	tp.repeat_wrap = get_json_int(obj, "repeat_wrap", 1) != 0;
+	tp.move_left = get_json_int(obj, "move_left", 1) != 0;
+	tp.antialias = get_json_int(obj, "antialias", 1) != 0;
+	tp.trace = get_json_int(obj, "trace", 0);
+
+	return create_text_element(ep, tp, received_ns, db, id);
+}
+
+// parses an add_stream command, NULL when its source cannot be used
+disp_element_t *create_stream_element(const json_t *const obj, double_buffer_t *const db, std::string *const id)
+{
+	disp_element_t *de = new_element(obj, db, id);
+	de -> kind = EK_STREAM;
+
+	const std::string shm_name = get_json_str(obj, "shm", "");
+	const int late_ms = get_json_int(obj, "late_ms", DEFAULT_STREAM_LATE_MS);
+
+	try
+	{
+		if (shm_name.empty())
+			de -> stream = new push_stream_source(de -> w, de -> h, late_ms);
+		else
+			de -> stream = new shm_stream_source(shm_name, de -> w, de -> h, late_ms);
+	}
+	catch(const std::string & e)
+	{
+		log_msg(LL_ERROR, "cannot start stream %s: %s", id -> c_str(), e.c_str());
+
+		delete_element(de);
+
+		return NULL;
+	}
+
+	return de;
+}
+
+// parses an add_image command and looks up its file in the asset cache,
+// NULL when it cannot be decoded
+disp_element_t *create_image_element(const json_t *const obj, double_buffer_t *const db, std::string *const id)
+{
+	disp_element_t *de = new_element(obj, db, id);
+	de -> kind = EK_IMAGE;
+	de -> text = get_json_str(obj, "file", ""); // also what the log shows for it
+	de -> pps = get_json_int(obj, "pps", 0); // 0: does not scroll
+	check_range(&de -> pps, 0, db -> w);
+	de -> repeat_wrap = get_json_int(obj, "repeat_wrap", 0) != 0;
+	de -> move_left = get_json_int(obj, "move_left", 1) != 0;
+
+	try
+	{
+		if (de -> text.empty())
+			throw std::string("no file given");
+
+		de -> asset = db -> assets -> get(de -> text);
+	}
+	catch(const std::string & e)
+	{
+		log_msg(LL_ERROR, "cannot show image %s: %s", id -> c_str(), e.c_str());
+
+		delete_element(de);
+
+		return NULL;
+	}
+
+	const asset_t *const a = de -> asset.get();
+
+	// an image can be a strip of frames of frame_w pixels wide
+	de -> sprite_w = get_json_int(obj, "frame_w", a -> w);
+	check_range(&de -> sprite_w, 1, a -> w);
+
+	const int per_image = a -> w / de -> sprite_w;
+
+	// one duration for all frames, or one per frame where the last one
+	// also counts for the frames after it
+	const json_t *const frame_ms = json_object_get(obj, "frame_ms");
+	int64_t end_us = 0;
+
+	for(size_t i=0; i<a -> images.size(); i++)
+	{
+		for(int j=0; j<per_image; j++)
+		{
+			int ms = DEFAULT_FRAME_MS;
+
+			if (json_is_array(frame_ms) && json_array_size(frame_ms) > 0)
+				ms = int(json_number_value(json_array_get(frame_ms, std::min(de -> sprite.size(), json_array_size(frame_ms) - 1))));
+			else if (frame_ms)
+				ms = get_json_int(obj, "frame_ms", DEFAULT_FRAME_MS);
+
+			check_range(&ms, 1, 3600000);
+
+			end_us += ms * 1000ll;
+
+			sprite_frame_t sf = { int(i), j * de -> sprite_w, end_us };
+			de -> sprite.push_back(sf);
+		}
+	}
+
+	log_msg(LL_DEBUG, "image %s: %dx%d, %zu frames", de -> text.c_str(), a -> w, a -> h, de -> sprite.size());
+
+	return de;
+}
+
+// same id with the same layout: only the text changes
+// clients_lock must be held, a read lock is enough
+bool replace_existing_text(const std::string & id, disp_element_t *const de, scene *const clients)
+{
+	scene::iterator it = clients -> find(id);
+
+	if (it == clients -> end() || it -> second -> terminate || !same_layout(it -> second, de))
+		return false;
+
+	replace_text(it -> second, de);
+
+	log_msg(LL_DEBUG, "Replaced text of text-scroller with id %s", id.c_str());
+
+	return true;
+}
+
+// clients_lock must be held for writing
+void insert_element(const std::string & id, disp_element_t *const de, double_buffer_t *const db, scene *const clients)
+{
+	de -> frames.publish();
+
+	scene::iterator it = clients -> find(id);
+
+	if (it != clients -> end())
+	{
+		disp_element_t *old_de = it -> second;
+		clients -> terminate(old_de);
+		db -> dirty -> add(old_de -> x, old_de -> y, old_de -> w, old_de -> h);
+
+		clients -> rename(it, id + format("_%d_terminate", rand()));
+	}
+
+	clients -> insert(id, de);
+
+	// while still locked: the compositor picks up the damage with the new scene
+	db -> dirty -> add(de -> x, de -> y, de -> w, de -> h);
+}
+
+void schedule_element(scheduler *const s, disp_element_t *const de)
+{
+	de -> start_ts = de -> last_tick_ts = get_mono_ns() / 1000;
+	de -> us_per_pps = de -> pps ? MILLION / de -> pps : 0;
+	s -> add(de, de -> start_ts);
+}
+
+// clients_lock must be held, a read lock is enough as only flags change
+bool stop_element(const std::string & id, double_buffer_t *const db, scene *const clients)
+{
+	scene::iterator it = clients -> find(id);
+
+	if (it == clients -> end())
+	{
+		log_msg(LL_WARNING, "id %s not found for stop", id.c_str());
+
+		return false;
+	}
+
+	log_msg(LL_INFO, "stopping %s", id.c_str());
+	clients -> terminate(it -> second);
+	db -> dirty -> add(it -> second -> x, it -> second -> y, it -> second -> w, it -> second -> h);
+
+	return true;
+}
+
+// clients_lock must be held
+void stop_all_elements(double_buffer_t *const db, scene *const clients)
+{
+	scene::iterator it = clients -> begin();
+
+	for(;it != clients -> end(); it++)
+		clients -> terminate(it -> second);
+
+	db -> dirty -> add_all();
+}
+
+typedef struct
+{
+	std::string cmd, id;
+	disp_element_t *de;
+	int brightness;
+} batch_op_t;
+
+// applies a list of commands to the scene in one go: the compositor sees
+// either none or all of them
+bool process_batch(const json_t *const commands, const int64_t received_ns, scheduler *const s, double_buffer_t *const db, pthread_rwlock_t *const clients_lock, scene *const clients, std::atomic_int *const brightness)
+{
+	bool ok = true;
+	std::vector<batch_op_t> ops;
+
+	// the slow part, rendering, is done before the scene is locked
+	for(size_t i=0; i<json_array_size(commands); i++)
+	{
+		const json_t *const cur = json_array_get(commands, i);
+
+		batch_op_t op;
+		op.cmd = get_json_str(cur, "cmd", "?");
+		op.de = NULL;
+		op.brightness = 0;
+
+		if (op.cmd == "add_text")
+		{
+			op.de = create_text_element(cur, received_ns, db, &op.id);
+
+			if (!op.de)
+			{
+				ok = false;
+				continue;
+			}
+		}
+		else if (op.cmd == "add_stream")
+		{
+			op.de = create_stream_element(cur, db, &op.id);
+
+			if (!op.de)
+			{
+				ok = false;
+				continue;
+			}
+		}
+		else if (op.cmd == "add_image")
+		{
+			op.de = create_image_element(cur, db, &op.id);
+
+			if (!op.de)
+			{
+				ok = false;
+				continue;
+			}
+		}
+		else if (op.cmd == "stop")
+			op.id = get_json_str(cur, "id", "");
+		else if (op.cmd == "brightness")
+			op.brightness = get_json_int(cur, "brightness", 100);
+		else if (op.cmd != "stop-all")
+		{
+			log_msg(LL_WARNING, "command %s cannot be part of a batch", op.cmd.c_str());
+			ok = false;
+			continue;
+		}
+
+		ops.push_back(op);
+	}
+
+	std::vector<disp_element_t *> new_elements, replaced;
+
+	pthread_rwlock_wrlock(clients_lock);
+
+	for(size_t i=0; i<ops.size(); i++)
+	{
+		const batch_op_t & op = ops.at(i);
+
+		if (op.de)
+		{
+			if (replace_existing_text(op.id, op.de, clients))
+				replaced.push_back(op.de);
+			else
+			{
+				insert_element(op.id, op.de, db, clients);
+				new_elements.push_back(op.de);
+			}
+		}
+		else if (op.cmd == "stop")
+			ok &= stop_element(op.id, db, clients);
+		else if (op.cmd == "stop-all")
+			stop_all_elements(db, clients);
+		else if (op.cmd == "brightness")
+			*brightness = op.brightness;
+	}
+
+	pthread_rwlock_unlock(clients_lock);
+
+	for(size_t i=0; i<replaced.size(); i++)
+		delete_element(replaced.at(i));
+
+	for(size_t i=0; i<new_elements.size(); i++)
+		schedule_element(s, new_elements.at(i));
+
+	log_msg(LL_DEBUG, "applied batch of %zu commands", ops.size());
+
+	return ok;
+}
+
+// swaps the text into the element with the same id and layout, or adds it as a new one
+void show_text_element(const std::string & id, disp_element_t *const de, scheduler *const s, double_buffer_t *const db, pthread_rwlock_t *const clients_lock, scene *const clients)
+{
+	pthread_rwlock_rdlock(clients_lock);
+	bool replaced = replace_existing_text(id, de, clients);
+	pthread_rwlock_unlock(clients_lock);
+
+	if (replaced)
+	{
+		delete_element(de);
+
+		return;
+	}
+
+	pthread_rwlock_wrlock(clients_lock);
+	insert_element(id, de, db, clients);
+	pthread_rwlock_unlock(clients_lock);
+
+	schedule_element(s, de);
+
+	log_msg(LL_INFO, "Started text-scroller with id %s", id.c_str());
+}
+
+// carries out one parsed command, returns false when that failed
+bool process_command(const json_t *const obj, const std::string & cmd, const int64_t received_ns, scheduler *const s, double_buffer_t *const db, pthread_rwlock_t *const clients_lock, scene *const clients, std::atomic_int *const brightness, std::string *const reply)
+{
+	if (cmd == "add_text")
+	{
+		std::string id;
+		disp_element_t *de = create_text_element(obj, received_ns, db, &id);
+
+		if (!de)
+			return false;
+
+		show_text_element(id, de, s, db, clients_lock, clients);
+	}
+	else if (cmd == "add_stream")
+	{
+		std::string id;
+		disp_element_t *de = create_stream_element(obj, db, &id);
+
+		if (!de)
+			return false;
+
+		pthread_rwlock_wrlock(clients_lock);
+		insert_element(id, de, db, clients);
+		pthread_rwlock_unlock(clients_lock);
+
+		schedule_element(s, de);
+
+		log_msg(LL_INFO, "Started stream with id %s", id.c_str());
+	}
+	else if (cmd == "add_image")
+	{
+		std::string id;
+		disp_element_t *de = create_image_element(obj, db, &id);
+
+		if (!de)
+			return false;
+
+		pthread_rwlock_wrlock(clients_lock);
+		insert_element(id, de, db, clients);
+		pthread_rwlock_unlock(clients_lock);
+
+		schedule_element(s, de);
+
+		log_msg(LL_INFO, "Started image with id %s", id.c_str());
+	}
+	else if (cmd == "stop")
+	{
+		pthread_rwlock_rdlock(clients_lock);
+		bool found = stop_element(get_json_str(obj, "id", ""), db, clients);
+		pthread_rwlock_unlock(clients_lock);
+
+		return found;
+	}
+	else if (cmd == "stop-all")
+	{
+		pthread_rwlock_rdlock(clients_lock);
+		stop_all_elements(db, clients);
+		pthread_rwlock_unlock(clients_lock);
+	}
+	else if (cmd == "batch")
+	{
+		const json_t *const commands = json_object_get(obj, "commands");
+
+		if (!json_is_array(commands))
+		{
+			log_msg(LL_WARNING, "batch without commands array");
+
+			return false;
+		}
+
+		return process_batch(commands, received_ns, s, db, clients_lock, clients, brightness);
+	}
+	else if (cmd == "brightness")
+	{
+		*brightness = get_json_int(obj, "brightness", 100);
+	}
+	else if (cmd == "rescan_fonts")
+	{
+		log_msg(LL_INFO, "rescanning fonts");
+		rescan_fonts();
+	}
+	else if (cmd == "stats")
+	{
+		if (reply)
+			*reply = get_stats_json(db, clients_lock, clients) + "\n";
+	}
+	else if (cmd == "trace")
+	{
+		if (reply)
+			*reply = get_trace_json(db) + "\n";
+	}
+	else if (cmd == "log_level")
+	{
+		// without a level it only tells which one is used
+		const std::string name = get_json_str(obj, "level", "");
+		log_level_t level = LL_INFO;
+
+		if (!name.empty())
+		{
+			if (!log_level_by_name(name.c_str(), &level))
+			{
+				log_msg(LL_WARNING, "log level %s not known", name.c_str());
+
+				return false;
+			}
+
+			log_set_level(level);
+		}
+
+		if (reply)
+			*reply = format("{\"cmd\":\"log_level\",\"level\":\"%s\"}\n", log_level_name(log_get_level()));
+	}
+	else if (cmd == "terminate")
+	{
+		log_msg(LL_INFO, "terminating application");
+		global_terminate = true;
+	}
+	else
+	{
+		log_msg(LL_WARNING, "command %s not known", cmd.c_str());
+
+		return false;
+	}
+
+	return true;
+}
+
+// reply, when not NULL, receives what should be sent back to the requester
+void process_json_request(const std::string & msg, const int64_t received_ns, scheduler *const s, double_buffer_t *const db, pthread_rwlock_t *const clients_lock, scene *const clients, std::atomic_int *const brightness, std::string *const reply)
+{
+	stats_count(CNT_COMMANDS);
+
+	json_error_t error;
+	json_t *obj = json_loadb(msg.data(), msg.size(), 0, &error);
+	if (!obj)
+	{
+		stats_count(CNT_PARSE_FAILURES);
+
+		log_msg(LL_WARNING, "JSON data failed to parse: %s", error.text);
+		return;
+	}
+
+	if (log_enabled(LL_DEBUG))
+	{
+		char *dump = json_dumps(obj, JSON_COMPACT);
+		log_msg(LL_DEBUG, "JSON parsed: %s", dump);
+		free(dump);
+	}
+
+	std::string cmd = get_json_str(obj, "cmd", "?");
+
+	bool ok = process_command(obj, cmd, received_ns, s, db, clients_lock, clients, brightness, reply);
+
+	// commands that have nothing to say answer with an ack when asked for it
+	if (reply && reply -> empty() && get_json_int(obj, "ack", 0))
+	{
+		json_t *ack = json_object();
+		json_object_set_new(ack, "cmd", json_string(cmd.c_str()));
+		json_object_set_new(ack, "ok", json_boolean(ok));
+
+		json_t *seq = json_object_get(obj, "seq");
+		if (seq)
+			json_object_set(ack, "seq", seq);
+
+		char *str = json_dumps(ack, JSON_COMPACT);
+		*reply = std::string(str) + "\n";
+		free(str);
+
+		json_decref(ack);
+	}
+
+	json_decref(obj);
+}
+
+bool is_binary_command(const std::string & msg)
+{
+	uint32_t magic = 0;
+
+	if (msg.size() < sizeof(binary_command_header_t))
+		return false;
+
+	memcpy(&magic, msg.data(), sizeof magic);
+
+	return ntohl(magic) == BINARY_COMMAND_MAGIC;
+}
+
+// the fields of a BC_ADD_TEXT, the strings pointing into msg; false when it does not fit
+static bool decode_binary_add_text(const std::string & msg, element_params_t *const ep, text_params_t *const tp)
+{
+	const size_t offset = sizeof(binary_command_header_t);
+
+	binary_add_text_t bat;
+
+	if (msg.size() < offset + sizeof bat)
+		return false;
+
+	memcpy(&bat, msg.data() + offset, sizeof bat);
+
+	const size_t text_len = ntohs(bat.text_len);
+	const char *const strings = msg.data() + offset + sizeof bat;
+
+	if (msg.size() != offset + sizeof bat + bat.id_len + bat.font_len + text_len)
+		return false;
+
+	ep -> id = strings;
+	ep -> id_len = bat.id_len;
+	ep -> x = int16_t(ntohs(bat.x));
+	ep -> y = int16_t(ntohs(bat.y));
+	ep -> w = ntohs(bat.w);
+	ep -> h = ntohs(bat.h);
+	ep -> duration_ms = ntohl(bat.duration_ms);
+	ep -> z_depth = bat.z_depth;
+	ep -> prio = bat.flags & BTF_PRIO;
+	ep -> use_key = bat.flags & BTF_TRANSPARENT;
+	ep -> key_r = bat.transparent_rgb[0];
+	ep -> key_g = bat.transparent_rgb[1];
+	ep -> key_b = bat.transparent_rgb[2];
+	ep -> alpha = bat.alpha;
+
+	tp -> font_name = bat.font_len ? strings + bat.id_len : NULL;
+	tp -> font_name_len = bat.font_len;
+	tp -> text = strings + bat.id_len + bat.font_len;
+	tp -> text_len = text_len;
+	tp -> pps = ntohs(bat.pps);
+	tp -> repeat_wrap = bat.flags & BTF_REPEAT_WRAP;
+	tp -> move_left = bat.flags & BTF_MOVE_LEFT;
+	tp -> antialias = bat.flags & BTF_ANTIALIAS;
+	tp -> trace = ntohl(bat.trace);
+
+	return true;
+}
+
+// a command in the encoding of binary_command.h: decoded in place, the
+// same as its json counterpart otherwise
+void process_binary_command(const std::string & msg, const int64_t received_ns, scheduler *const s, double_buffer_t *const db, pthread_rwlock_t *const clients_lock, scene *const clients, std::atomic_int *const brightness, std::string *const reply)
+{
+	stats_count(CNT_COMMANDS);
+	stats_count(CNT_BINARY_COMMANDS);
+
+	binary_command_header_t bch;
+	memcpy(&bch, msg.data(), sizeof bch);
+
+	const size_t offset = sizeof bch;
+	bool valid = bch.version == BINARY_COMMAND_VERSION, ok = false;
+
+	if (!valid)
+		log_msg(LL_WARNING, "binary command version %d is not supported", bch.version);
+	else if (bch.cmd == BC_ADD_TEXT)
+	{
+		element_params_t ep;
+		text_params_t tp;
+
+		valid = decode_binary_add_text(msg, &ep, &tp);
+
+		if (valid)
+		{
+			std::string id;
+			disp_element_t *de = create_text_element(ep, tp, received_ns, db, &id);
+
+			if (de)
+			{
+				show_text_element(id, de, s, db, clients_lock, clients);
+				ok = true;
+			}
+		}
+	}
+	else if (bch.cmd == BC_STOP)
+	{
+		binary_stop_t bs;
+
+		valid = msg.size() >= offset + sizeof bs;
+
+		if (valid)
+		{
+			memcpy(&bs, msg.data() + offset, sizeof bs);
+
+			valid = msg.size() == offset + sizeof bs + bs.id_len;
+		}
+
+		if (valid)
+		{
+			pthread_rwlock_rdlock(clients_lock);
+			ok = stop_element(msg.substr(offset + sizeof bs, bs.id_len), db, clients);
+			pthread_rwlock_unlock(clients_lock);
+		}
+	}
+	else if (bch.cmd == BC_STOP_ALL)
+	{
+		pthread_rwlock_rdlock(clients_lock);
+		stop_all_elements(db, clients);
+		pthread_rwlock_unlock(clients_lock);
+
+		ok = true;
+	}
+	else if (bch.cmd == BC_BRIGHTNESS)
+	{
+		binary_brightness_t bb;
+
+		valid = msg.size() == offset + sizeof bb;
+
+		if (valid)
+		{
+			memcpy(&bb, msg.data() + offset, sizeof bb);
+
+			*brightness = bb.brightness;
+			ok = true;
+		}
+	}
+	else
+	{
+		log_msg(LL_WARNING, "binary command %d not known", bch.cmd);
+	}
+
+	if (!valid)
+		stats_count(CNT_PARSE_FAILURES);
+
+	if (reply && (ntohs(bch.flags) & BCF_ACK))
+	{
+		binary_command_header_t ack;
+		ack.magic = htonl(BINARY_COMMAND_MAGIC);
+		ack.version = BINARY_COMMAND_VERSION;
+		ack.cmd = BC_ACK;
+		ack.flags = htons(ok ? BCF_OK : 0);
+		ack.seq = bch.seq;
+
+		reply -> assign((const char *)&ack, sizeof ack);
+	}
+}
+
+bool is_stream_fragment(const std::string & msg)
+{
+	uint32_t magic = 0;
+
+	if (msg.size() < sizeof(stream_fragment_header_t))
+		return false;
+
+	memcpy(&magic, msg.data(), sizeof magic);
+
+	return ntohl(magic) == STREAM_FRAGMENT_MAGIC;
+}
+
+// a piece of a frame for a push stream element
+void process_stream_fragment(const std::string & msg, pthread_rwlock_t *const clients_lock, scene *const clients)
+{
+	stats_count(CNT_STREAM_FRAGMENTS);
+
+	stream_fragment_header_t sfh;
+	memcpy(&sfh, msg.data(), sizeof sfh);
+
+	const size_t data_offset = sizeof sfh + sfh.id_len;
+
+	if (msg.size() < data_offset)
+	{
+		stats_count(CNT_STREAM_REJECTED);
+		return;
+	}
+
+	const std::string id = msg.substr(sizeof sfh, sfh.id_len);
+
+	bool ok = false, complete = false;
+
+	pthread_rwlock_rdlock(clients_lock);
+
+	scene::iterator it = clients -> find(id);
+
+	if (it != clients -> end() && it -> second -> kind == EK_STREAM && !it -> second -> terminate)
+	{
+		disp_element_t *const de = it -> second;
+
+		// only push streams take pieces
+		push_stream_source *const pss = dynamic_cast<push_stream_source *>(de -> stream);
+
+		if (pss)
+			ok = pss -> put_fragment(ntohl(sfh.frame_nr), ntohl(sfh.offset), ntohl(sfh.total), (const uint8_t *)msg.data() + data_offset, msg.size() - data_offset, &complete);
+
+		// no need to wait for the scheduler to notice
+		if (complete && !de -> pause)
+			de -> dirty -> add(de -> x, de -> y, de -> w, de -> h);
+	}
+
+	pthread_rwlock_unlock(clients_lock);
+
+	if (!ok)
+		stats_count(CNT_STREAM_REJECTED);
+}
+
+// the top-level "id" of a json object, found without parsing the rest;
+// false when there is none
+static bool find_json_id(const std::string & msg, const char **const id, size_t *const id_len)
+{
+	const size_t n = msg.size();
+	int depth = 0;
+
+	for(size_t i=0; i<n; i++)
+	{
+		const char ch = msg[i];
+
+		if (ch == '{' || ch == '[')
+			depth++;
+		else if (ch == '}' || ch == ']')
+			depth--;
+		else if (ch == '"')
+		{
+			// a string: find where it ends
+			const size_t start = i + 1;
+
+			for(i=start; i<n && msg[i] != '"'; i++)
+			{
+				if (msg[i] == '\\')
+					i++;
+			}
+
+			if (i >= n)
+				return false;
+
+			if (depth != 1 || i - start != 2 || msg.compare(start, 2, "id") != 0)
+				continue;
+
+			// a key when a ':' follows
+			size_t v = msg.find_first_not_of(" \t\r\n", i + 1);
+
+			if (v == std::string::npos || msg[v] != ':')
+				continue;
+
+			v = msg.find_first_not_of(" \t\r\n", v + 1);
+
+			if (v == std::string::npos || msg[v] != '"')
+				return false;
+
+			size_t e = v + 1;
+
+			for(; e<n && msg[e] != '"'; e++)
+			{
+				if (msg[e] == '\\')
+					e++;
+			}
+
+			if (e >= n)
+				return false;
+
+			*id = msg.data() + v + 1;
+			*id_len = e - v - 1;
+
+			return true;
+		}
+	}
+
+	return false;
+}
+
+uint32_t get_command_order_key(const std::string & msg)
+{
+	const char *id = NULL;
+	size_t id_len = 0;
+	std::string unescaped;
+
+	if (is_stream_fragment(msg))
+	{
+		stream_fragment_header_t sfh;
+		memcpy(&sfh, msg.data(), sizeof sfh);
+
+		if (msg.size() >= sizeof sfh + sfh.id_len)
+		{
+			id = msg.data() + sizeof sfh;
+			id_len = sfh.id_len;
+		}
+	}
+	else if (is_binary_command(msg))
+	{
+		binary_command_header_t bch;
+		memcpy(&bch, msg.data(), sizeof bch);
+
+		const size_t offset = sizeof bch;
+
+		if (bch.cmd == BC_ADD_TEXT && msg.size() >= offset + sizeof(binary_add_text_t))
+		{
+			binary_add_text_t bat;
+			memcpy(&bat, msg.data() + offset, sizeof bat);
+
+			if (msg.size() >= offset + sizeof bat + bat.id_len)
+			{
+				id = msg.data() + offset + sizeof bat;
+				id_len = bat.id_len;
+			}
+		}
+		else if (bch.cmd == BC_STOP && msg.size() >= offset + sizeof(binary_stop_t))
+		{
+			binary_stop_t bs;
+			memcpy(&bs, msg.data() + offset, sizeof bs);
+
+			if (msg.size() >= offset + sizeof bs + bs.id_len)
+			{
+				id = msg.data() + offset + sizeof bs;
+				id_len = bs.id_len;
+			}
+		}
+	}
+	else if (!find_json_id(msg, &id, &id_len))
+		return 0;
+	else if (memchr(id, '\\', id_len))
+	{
+		// "a\u0062" is the same element as "ab": decode the escapes the
+		// way the command itself will be (rare, so jansson may do it)
+		const std::string wrapped = "[\"" + std::string(id, id_len) + "\"]";
+
+		json_error_t error;
+		json_t *arr = json_loadb(wrapped.data(), wrapped.size(), 0, &error);
+		const char *const value = json_string_value(json_array_get(arr, 0));
+
+		if (value)
+			unescaped = value;
+
+		json_decref(arr);
+
+		// not valid json: the command will be rejected anyway
+		if (unescaped.empty())
+			return 0;
+
+		id = unescaped.data();
+		id_len = unescaped.size();
+	}
+
+	if (!id)
+		return 0;
+
+	// FNV-1a
+	uint32_t hash = 2166136261u;
+
+	for(size_t i=0; i<id_len; i++)
+	{
+		hash ^= uint8_t(id[i]);
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
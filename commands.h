@@ -0,0 +1,54 @@
+#ifndef __COMMANDS_H__
+#define __COMMANDS_H__
+
+#include <atomic>
+#include <pthread.h>
+#include <stdint.h>
+#include <string>
+
+#include "disp_element.h"
+#include "double_buffer.h"
+#include "scene.h"
+#include "scheduler.h"
+
+// set by the terminate command and the signal handlers
+extern std::atomic_bool global_terminate;
+
+// how long an image element shows a frame when the command does not say
+#define DEFAULT_FRAME_MS 100
+// how often an image that neither moves nor animates looks at its duration
+#define IMAGE_POLL_US 100000
+
+// called by the scheduler each time the element should scroll one pixel
+int64_t step_display_element(disp_element_t *const de, const int64_t now);
+
+void pause_all_but(pthread_rwlock_t *const clients_lock, scene *const clients, const std::string & skip, const bool pause);
+void delete_element(disp_element_t *const de);
+
+// remove the elements the scheduler is done with
+bool purge_elements(pthread_rwlock_t *const clients_lock, scene *const clients);
+void terminate_elements(scheduler *const s, pthread_rwlock_t *const clients_lock, scene *const clients);
+
+// so that a reply stays well below 1MB
+#define MAX_TRACES_PER_REPLY 8192
+
+std::string get_stats_json(double_buffer_t *const db, pthread_rwlock_t *const clients_lock, scene *const clients);
+std::string get_trace_json(double_buffer_t *const db);
+
+// commands in the encoding of binary_command.h instead of json
+bool is_binary_command(const std::string & msg);
+void process_binary_command(const std::string & msg, const int64_t received_ns, scheduler *const s, double_buffer_t *const db, pthread_rwlock_t *const clients_lock, scene *const clients, std::atomic_int *const brightness, std::string *const reply);
+
+// raw frame data for stream elements instead of a json command
+bool is_stream_fragment(const std::string & msg);
+void process_stream_fragment(const std::string & msg, pthread_rwlock_t *const clients_lock, scene *const clients);
+
+// received_ns is when the command was read from the socket (get_mono_ns())
+// reply, when not NULL, receives what should be sent back to the requester
+void process_json_request(const std::string & msg, const int64_t received_ns, scheduler *const s, double_buffer_t *const db, pthread_rwlock_t *const clients_lock, scene *const clients, std::atomic_int *const brightness, std::string *const reply);
+
+// the same for every command (json, binary or stream fragment) about the
+// same element id, 0 for commands without one
+uint32_t get_command_order_key(const std::string & msg);
+
+#endif
@@ -0,0 +1,388 @@
+#include <algorithm>
+#include <string.h>
+
+#include "compositor.h"
+#include "stats.h"
+#include "stream.h"
+#include "utils.h"
+
+compositor::compositor(double_buffer_t *const db_in, pthread_rwlock_t *const clients_lock_in, scene *const clients_in, const int n_threads) : db(db_in), clients_lock(clients_lock_in), clients(clients_in), elements_visible(false), last_prio(false), screen_foreign(false), work(NULL), generation(0), n_tiles(0), next_tile(0), tiles_pending(0), tile_y(0), tile_h(0), stop_flag(false)
+{
+	pthread_mutex_init(&lock, NULL);
+	pthread_cond_init(&work_cond, NULL);
+	pthread_cond_init(&done_cond, NULL);
+
+	// the thread calling compose() draws a tile as well
+	for(int i=1; i<n_threads; i++)
+	{
+		pthread_t th;
+		pthread_create(&th, NULL, thread_main, this);
+		set_thread_name(th, format("compose%d", i));
+
+		workers.push_back(th);
+	}
+}
+
+compositor::~compositor()
+{
+	pthread_mutex_lock(&lock);
+	stop_flag = true;
+	pthread_cond_broadcast(&work_cond);
+	pthread_mutex_unlock(&lock);
+
+	for(size_t i=0; i<workers.size(); i++)
+	{
+		void *dummy = NULL;
+		pthread_join(workers.at(i), &dummy);
+	}
+
+	pthread_cond_destroy(&done_cond);
+	pthread_cond_destroy(&work_cond);
+	pthread_mutex_destroy(&lock);
+}
+
+void *compositor::thread_main(void *p)
+{
+	((compositor *)p) -> run();
+
+	return NULL;
+}
+
+void compositor::run()
+{
+	uint64_t seen = 0;
+
+	pthread_mutex_lock(&lock);
+
+	for(;;)
+	{
+		while(generation == seen && !stop_flag)
+			pthread_cond_wait(&work_cond, &lock);
+
+		if (stop_flag)
+			break;
+
+		seen = generation;
+
+		pthread_mutex_unlock(&lock);
+
+		run_tiles();
+
+		pthread_mutex_lock(&lock);
+	}
+
+	pthread_mutex_unlock(&lock);
+}
+
+// draws tiles until none are left; whoever finishes the last one wakes compose()
+void compositor::run_tiles()
+{
+	pthread_mutex_lock(&lock);
+
+	while(next_tile < n_tiles)
+	{
+		const int t = next_tile++;
+
+		pthread_mutex_unlock(&lock);
+
+		const int y = tile_y + t * tile_h;
+		rect_t tile = { 0, y, db -> w, std::min(tile_h, db -> h - y) };
+
+		if (tile.h > 0)
+			draw_tile(tile);
+
+		pthread_mutex_lock(&lock);
+
+		if (--tiles_pending == 0)
+			pthread_cond_signal(&done_cond);
+	}
+
+	pthread_mutex_unlock(&lock);
+}
+
+// copy the part of the element that is in r straight from its text image,
+// or frame of an image: text_w columns from img_x on in an image of
+// img_stride x img_h pixels, scrolled by scroll_pixels
+void compositor::draw_scroller(const disp_element_t *const de, const int64_t scroll_pixels, const rect_t & r, const uint8_t *const img, const int img_stride, const int img_h, const int img_x, const int text_w)
+{
+	if (text_w == 0)
+		return;
+
+	// column in the text image that is at the left of the element
+	int scroll_x = scroll_pixels % text_w;
+	if (!de -> move_left)
+		scroll_x = (text_w - scroll_x) % text_w;
+
+	// ...and the one at the left of r
+	int src_x = scroll_x + r.x - de -> x;
+
+	if (de -> repeat_wrap)
+		src_x %= text_w;
+
+	for(int done = 0; done < r.w && src_x < text_w;) {
+		int n = std::min(r.w - done, text_w - src_x);
+
+		const int64_t start = get_mono_ns();
+		bitblit(db -> data, db -> w, db -> h, r.x + done, r.y, img, img_stride, img_h, img_x + src_x, r.y - de -> y, n, r.h, &de -> blit_op);
+		stats_add_time(STAGE_BITBLIT, get_mono_ns() - start);
+
+		done += n;
+
+		if (!de -> repeat_wrap)
+			break;
+
+		src_x = 0;
+	}
+}
+
+// straight from the buffer the frame was received in
+void compositor::draw_stream(const disp_element_t *const de, const rect_t & r)
+{
+	const uint8_t *const pixels = de -> stream -> get_pixels();
+
+	if (!pixels)
+		return;
+
+	const int64_t start = get_mono_ns();
+	bitblit(db -> data, db -> w, db -> h, r.x, r.y, pixels, de -> w, de -> h, r.x - de -> x, r.y - de -> y, r.w, r.h, &de -> blit_op);
+	stats_add_time(STAGE_BITBLIT, get_mono_ns() - start);
+}
+
+// the part of the damage that is in tile; the tiles do not overlap so they
+// can be drawn at the same time
+void compositor::draw_tile(const rect_t & tile)
+{
+	for(size_t i=0; i<work -> size(); i++)
+	{
+		rect_t r;
+
+		if (!rect_intersect(work -> at(i), tile, &r))
+			continue;
+
+		for(int y=r.y; y<r.y + r.h; y++)
+			memset(&db -> data[(y * db -> w + r.x) * 3], 0x00, r.w * 3);
+
+		// draw the part of each element that is in this rectangle, back to front
+		for(size_t e=0; e<shown.size(); e++)
+		{
+			const disp_element_t *const de = shown[e];
+			const position_t & pos = positions[e];
+
+			rect_t de_r = { de -> x, de -> y, de -> w, de -> h }, part;
+
+			if (!rect_intersect(r, de_r, &part))
+				continue;
+
+			if (de -> kind == EK_STREAM)
+			{
+				draw_stream(de, part);
+
+				continue;
+			}
+
+			if (de -> kind == EK_IMAGE)
+			{
+				const asset_t *const a = de -> asset.get();
+				const sprite_frame_t & sf = de -> sprite.at(pos.sprite_frame);
+
+				draw_scroller(de, pos.scroll_pixels, part, a -> images.at(sf.image), a -> w, a -> h, sf.src_x, de -> sprite_w);
+
+				continue;
+			}
+
+			const text_frame_t & tf = de -> frames.get_front();
+
+			draw_scroller(de, pos.scroll_pixels, part, tf.img, tf.w, de -> h, 0, tf.w);
+		}
+	}
+}
+
+bool compositor::compose(std::vector<rect_t> *const rects)
+{
+	pthread_rwlock_rdlock(clients_lock);
+
+	// taken while holding the lock: changes to the scene add their damage
+	// before they release it, so a change is never drawn halfway
+	if (!db -> dirty -> take(rects)) {
+		pthread_rwlock_unlock(clients_lock);
+
+		return false;
+	}
+
+	// the screensaver or on/off message is in the buffer
+	if (screen_foreign) {
+		rect_t all = { 0, 0, db -> w, db -> h };
+
+		rects -> clear();
+		rects -> push_back(all);
+
+		screen_foreign = false;
+	}
+
+	// if there's one or more prio-elements, then do not draw any others
+	const bool prio = clients -> has_prio();
+
+	// a different set of elements is shown: everything must be redone
+	if (prio != last_prio)
+	{
+		rect_t all = { 0, 0, db -> w, db -> h };
+
+		rects -> clear();
+		rects -> push_back(all);
+
+		last_prio = prio;
+	}
+
+	// already in drawing order
+	const std::vector<disp_element_t *> & elements = clients -> get_by_depth();
+	bool any_shown = false;
+
+	for(size_t i=0; i<elements.size(); i++)
+	{
+		disp_element_t *const de = elements[i];
+
+		// switch to the latest text or frame, never waits for whoever produces it
+		if (de -> kind == EK_STREAM)
+			de -> stream -> acquire();
+		else
+			de -> frames.acquire();
+
+		any_shown |= (!prio || de -> prio) && !(de -> terminate || de -> pause);
+	}
+
+	// which elements get drawn, and the bookkeeping for those, is done here
+	// so that the tiles only read them
+	shown.clear();
+	positions.clear();
+
+	int y0 = db -> h, y1 = 0, pixels = 0;
+
+	for(size_t i=0; i<rects -> size(); i++)
+	{
+		const rect_t & r = rects -> at(i);
+
+		y0 = std::min(y0, r.y);
+		y1 = std::max(y1, r.y + r.h);
+		pixels += r.w * r.h;
+	}
+
+	for(size_t e=0; e<elements.size(); e++)
+	{
+		disp_element_t *const de = elements[e];
+
+		if ((prio && !de -> prio) || de -> terminate || de -> pause)
+			continue;
+
+		rect_t de_r = { de -> x, de -> y, de -> w, de -> h }, part;
+		bool in_damage = false;
+
+		for(size_t i=0; i<rects -> size() && !in_damage; i++)
+			in_damage = rect_intersect(rects -> at(i), de_r, &part);
+
+		if (!in_damage)
+			continue;
+
+		shown.push_back(de);
+
+		position_t pos = { de -> scroll_pixels, de -> sprite_frame };
+		positions.push_back(pos);
+
+		if (de -> kind == EK_STREAM)
+		{
+			streams_drawn.push_back(de);
+
+			continue;
+		}
+
+		if (de -> kind == EK_IMAGE)
+			continue;
+
+		text_frame_t & tf = de -> frames.get_front();
+
+		if (tf.trace)
+		{
+			trace_record_t tr = { tf.trace, tf.received_ns, 0, 0 };
+			traced.push_back(tr);
+
+			tf.trace = 0;
+		}
+	}
+
+	// one band of rows per thread, over the rows that were damaged
+	const int n_threads = std::min(int(workers.size()) + 1, std::max(1, pixels / COMPOSE_MIN_TILE_PIXELS));
+
+	work = rects;
+
+	if (n_threads <= 1 || y1 - y0 < n_threads)
+	{
+		rect_t all = { 0, 0, db -> w, db -> h };
+
+		draw_tile(all);
+	}
+	else
+	{
+		pthread_mutex_lock(&lock);
+
+		tile_y = y0;
+		tile_h = (y1 - y0 + n_threads - 1) / n_threads;
+		n_tiles = tiles_pending = n_threads;
+		next_tile = 0;
+		generation++;
+
+		pthread_cond_broadcast(&work_cond);
+
+		pthread_mutex_unlock(&lock);
+
+		run_tiles();
+
+		pthread_mutex_lock(&lock);
+
+		while(tiles_pending > 0)
+			pthread_cond_wait(&done_cond, &lock);
+
+		pthread_mutex_unlock(&lock);
+	}
+
+	work = NULL;
+
+	// a producer that overwrote a frame while it was copied: redo it with the next one
+	for(size_t i=0; i<streams_drawn.size(); i++)
+	{
+		disp_element_t *const de = streams_drawn.at(i);
+
+		if (!de -> stream -> still_valid())
+			db -> dirty -> add(de -> x, de -> y, de -> w, de -> h);
+	}
+
+	streams_drawn.clear();
+
+	pthread_rwlock_unlock(clients_lock);
+
+	if (!traced.empty())
+	{
+		const int64_t now = get_mono_ns();
+
+		for(size_t i=0; i<traced.size(); i++)
+			traced.at(i).composed_ns = now;
+	}
+
+	elements_visible = any_shown;
+
+	return true;
+}
+
+void compositor::frame_pushed()
+{
+	if (traced.empty())
+		return;
+
+	const int64_t now = get_mono_ns();
+
+	for(size_t i=0; i<traced.size(); i++)
+		traced.at(i).pushed_ns = now;
+
+	if (db -> traces)
+		db -> traces -> add(traced);
+
+	traced.clear();
+}
@@ -0,0 +1,76 @@
+#ifndef __COMPOSITOR_H__
+#define __COMPOSITOR_H__
+
+#include <pthread.h>
+#include <vector>
+
+#include "damage.h"
+#include "disp_element.h"
+#include "double_buffer.h"
+#include "scene.h"
+#include "trace.h"
+
+#define DEFAULT_COMPOSE_THREADS 1
+// less damage than this per thread is drawn by the calling thread alone:
+// waking the others would take longer
+#define COMPOSE_MIN_TILE_PIXELS 2048
+
+// draws the elements of the scene into db -> data, only where it changed;
+// with more than one thread the damaged rows are cut into horizontal tiles
+// that are drawn at the same time, the calling thread being one of them
+class compositor {
+private:
+	double_buffer_t *const db;
+	pthread_rwlock_t *const clients_lock;
+	scene *const clients;
+	bool elements_visible, last_prio, screen_foreign;
+	// traced texts drawn in the last compose(), not on the display yet
+	std::vector<trace_record_t> traced;
+	// stream elements drawn in this compose()
+	std::vector<disp_element_t *> streams_drawn;
+	// the elements drawn in this compose(), back to front
+	std::vector<const disp_element_t *> shown;
+	// where each of those is in this compose(): read once, as the scheduler
+	// keeps moving them while the tiles are drawn
+	typedef struct {
+		int64_t scroll_pixels;
+		int sprite_frame;
+	} position_t;
+	std::vector<position_t> positions;
+	// the damage of this compose(), read by all tiles
+	const std::vector<rect_t> *work;
+
+	std::vector<pthread_t> workers;
+	pthread_mutex_t lock;
+	pthread_cond_t work_cond, done_cond;
+	uint64_t generation;
+	// the tiles of this generation: n_tiles bands of tile_h rows from tile_y on
+	int n_tiles, next_tile, tiles_pending, tile_y, tile_h;
+	bool stop_flag;
+
+	static void *thread_main(void *p);
+	void run();
+	void run_tiles();
+
+	void draw_tile(const rect_t & tile);
+	void draw_scroller(const disp_element_t *const de, const int64_t scroll_pixels, const rect_t & r, const uint8_t *const img, const int img_stride, const int img_h, const int img_x, const int text_w);
+	void draw_stream(const disp_element_t *const de, const rect_t & r);
+
+public:
+	compositor(double_buffer_t *const db_in, pthread_rwlock_t *const clients_lock_in, scene *const clients_in, const int n_threads);
+	virtual ~compositor();
+
+	// recompose only the damaged rectangles, returns false when nothing changed
+	bool compose(std::vector<rect_t> *const rects);
+
+	// something else (screensaver, on/off message) was drawn in the buffer
+	void set_foreign(const bool f) { screen_foreign = f; }
+
+	// whether the last compose() drew any element
+	bool any_visible() const { return elements_visible; }
+
+	// the frame of the last compose() was handed to the display
+	void frame_pushed();
+};
+
+#endif
@@ -0,0 +1,132 @@
+#include <algorithm>
+
+#include "damage.h"
+
+static rect_t rect_union(const rect_t & a, const rect_t & b)
+{
+	rect_t r;
+	r.x = std::min(a.x, b.x);
+	r.y = std::min(a.y, b.y);
+	r.w = std::max(a.x + a.w, b.x + b.w) - r.x;
+	r.h = std::max(a.y + a.h, b.y + b.h) - r.y;
+
+	return r;
+}
+
+bool rect_intersect(const rect_t & a, const rect_t & b, rect_t *const out)
+{
+	int x0 = std::max(a.x, b.x), y0 = std::max(a.y, b.y);
+	int x1 = std::min(a.x + a.w, b.x + b.w), y1 = std::min(a.y + a.h, b.y + b.h);
+
+	if (x1 <= x0 || y1 <= y0)
+		return false;
+
+	out -> x = x0;
+	out -> y = y0;
+	out -> w = x1 - x0;
+	out -> h = y1 - y0;
+
+	return true;
+}
+
+damage_tracker::damage_tracker(const int w_in, const int h_in) : w(w_in), h(h_in)
+{
+	pthread_mutex_init(&lock, NULL);
+
+	rects.reserve(MAX_DAMAGE_RECTS + 1);
+}
+
+damage_tracker::~damage_tracker()
+{
+	pthread_mutex_destroy(&lock);
+}
+
+// lock must be held
+void damage_tracker::merge(rect_t r)
+{
+	// fold everything that touches r into it, repeat as the union may now touch others
+	for(size_t i=0; i<rects.size();)
+	{
+		const rect_t & cur = rects.at(i);
+
+		if (cur.x <= r.x + r.w && r.x <= cur.x + cur.w && cur.y <= r.y + r.h && r.y <= cur.y + cur.h)
+		{
+			r = rect_union(r, cur);
+
+			rects.erase(rects.begin() + i);
+			i = 0;
+		}
+		else
+		{
+			i++;
+		}
+	}
+
+	if (rects.size() < MAX_DAMAGE_RECTS)
+	{
+		rects.push_back(r);
+		return;
+	}
+
+	// too many: join with the one that grows the least
+	size_t best = 0;
+	int best_growth = -1;
+
+	for(size_t i=0; i<rects.size(); i++)
+	{
+		rect_t u = rect_union(r, rects.at(i));
+		int growth = u.w * u.h - rects.at(i).w * rects.at(i).h;
+
+		if (best_growth == -1 || growth < best_growth)
+		{
+			best = i;
+			best_growth = growth;
+		}
+	}
+
+	rect_t u = rect_union(r, rects.at(best));
+	rects.erase(rects.begin() + best);
+
+	merge(u);
+}
+
+void damage_tracker::add(const int x, const int y, const int w, const int h)
+{
+	rect_t screen = { 0, 0, this -> w, this -> h };
+	rect_t in = { x, y, w, h }, r;
+
+	if (!rect_intersect(screen, in, &r))
+		return;
+
+	pthread_mutex_lock(&lock);
+
+	merge(r);
+
+	pthread_mutex_unlock(&lock);
+}
+
+void damage_tracker::add_all()
+{
+	rect_t screen = { 0, 0, w, h };
+
+	pthread_mutex_lock(&lock);
+
+	rects.clear();
+	rects.push_back(screen);
+
+	pthread_mutex_unlock(&lock);
+}
+
+bool damage_tracker::take(std::vector<rect_t> *const out)
+{
+	out -> clear();
+
+	pthread_mutex_lock(&lock);
+
+	// swap keeps both vectors' capacity, so no allocations here
+	out -> swap(rects);
+
+	pthread_mutex_unlock(&lock);
+
+	return !out -> empty();
+}
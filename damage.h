@@ -0,0 +1,35 @@
+#ifndef __DAMAGE_H__
+#define __DAMAGE_H__
+
+#include <pthread.h>
+#include <vector>
+
+#define MAX_DAMAGE_RECTS 8
+
+typedef struct {
+	int x, y, w, h;
+} rect_t;
+
+bool rect_intersect(const rect_t & a, const rect_t & b, rect_t *const out);
+
+// collects the parts of the frame that changed since the compositor last looked
+class damage_tracker {
+private:
+	pthread_mutex_t lock;
+	std::vector<rect_t> rects;
+	const int w, h;
+
+	void merge(rect_t r);
+
+public:
+	damage_tracker(const int w_in, const int h_in);
+	virtual ~damage_tracker();
+
+	void add(const int x, const int y, const int w, const int h);
+	void add_all();
+
+	// moves the collected rectangles to out, returns false when nothing changed
+	bool take(std::vector<rect_t> *const out);
+};
+
+#endif
@@ -0,0 +1,85 @@
+#ifndef __DISP_ELEMENT_H__
+#define __DISP_ELEMENT_H__
+
+#include <atomic>
+#include <pthread.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "asset_cache.h"
+#include "blit.h"
+#include "damage.h"
+#include "triple_buffer.h"
+
+class font;
+class scene;
+class stream_source;
+
+typedef enum { EK_TEXT, EK_STREAM, EK_IMAGE } element_kind_t;
+
+// a rendered text, owned by whatever slot of the element's triple buffer it is in
+typedef struct {
+	font *f;
+	uint8_t *img;
+	int w;
+	// set when the command asked for a trace; cleared by the compositor
+	// once it has drawn this text
+	uint32_t trace;
+	int64_t received_ns;
+} text_frame_t;
+
+// a frame of an image element: a part of one of the images of its asset
+typedef struct {
+	int image, src_x;
+	// when it ends, counted from the start of the animation
+	int64_t end_us;
+} sprite_frame_t;
+
+typedef struct {
+	element_kind_t kind;
+	std::string font_name, default_font;
+	int x, y, w, h;
+	int pps, duration, z_depth;
+	bool prio, repeat_wrap, move_left, antialias;
+	// producer_lock: replaced together with the rendered text
+	std::string text;
+	blit_op_t blit_op;
+	// terminate and pause are changed through the scene, it counts them
+	std::atomic_bool terminate, finished;
+	std::atomic_int pause;
+	scene *owner;
+	// order of insertion, breaks ties in z_depth
+	uint64_t seq;
+	damage_tracker *dirty;
+	std::atomic_bool *want_flash;
+
+	// the rendered text, read directly by the compositor; an add_text for
+	// the same id and layout publishes a new one here instead of replacing
+	// the element
+	triple_buffer<text_frame_t> frames;
+	pthread_mutex_t producer_lock;
+
+	// pixels scrolled since the start, set by the scheduler
+	std::atomic<int64_t> scroll_pixels;
+	// when the duration is over, 0 for never; like the other timestamps
+	// here in microseconds on the scheduler's (monotonic) clock
+	std::atomic<int64_t> end_ts;
+
+	// the frames of a stream element, NULL for text
+	stream_source *stream;
+
+	// image elements: the decoded file, shared with all others that show
+	// it, and the frames of the animation (one when it is not animated)
+	asset_ptr_t asset;
+	std::vector<sprite_frame_t> sprite;
+	int sprite_w;
+	// index in sprite, set by the scheduler
+	std::atomic_int sprite_frame;
+
+	// only touched by the scheduler thread
+	int64_t start_ts, us_per_pps, paused_us, last_tick_ts;
+	uint32_t stream_seen;
+} disp_element_t;
+
+#endif
@@ -0,0 +1,29 @@
+#ifndef __DOUBLE_BUFFER_H__
+#define __DOUBLE_BUFFER_H__
+
+#include <atomic>
+#include <stdint.h>
+#include <string>
+
+#include "damage.h"
+#include "trace.h"
+
+class asset_cache;
+class frame_pacer;
+
+// the frame that is composed, and what the commands need to know about the display
+typedef struct {
+	bool flag;
+	uint8_t *data;
+	int w, h;
+	std::atomic_int *brightness;
+	bool screensaver;
+	std::atomic_bool want_flash;
+	damage_tracker *dirty;
+	frame_pacer *pacer;
+	trace_log *traces;
+	asset_cache *assets;
+	std::string font_name;
+} double_buffer_t;
+
+#endif
@@ -1,19 +1,28 @@
 #include <algorithm>
 #include <assert.h>
 #include <fontconfig/fontconfig.h>
+#include <string.h>
+#include <unordered_map>
 #include "font.h"
+#include "pool.h"
+#include "stats.h"
 #include "utils.h"
 
 //#define DEBUG
 //#define DEBUG_IMG
 
-pthread_mutex_t freetype2_lock = PTHREAD_MUTEX_INITIALIZER;
+// only protects the lists of contexts: renders run in parallel, each in a context of its own
+pthread_mutex_t contexts_lock = PTHREAD_MUTEX_INITIALIZER;
 pthread_mutex_t fontconfig_lock = PTHREAD_MUTEX_INITIALIZER;
 
-FT_Library font::library;
-std::map<std::string, FT_Face> font::font_cache;
+// both protected by fontconfig_lock
+FcConfig *fc_config = NULL;
+std::unordered_map<std::string, std::string> font_name_cache; // name -> file, empty when no match
 
-void font::draw_bitmap(const FT_Bitmap *const bitmap, const int target_height, const FT_Int x, const FT_Int y, uint8_t r, uint8_t g, uint8_t b, const bool invert, const bool underline, const bool rainbow)
+std::vector<ft_context_t *> font::contexts, font::free_contexts;
+glyph_cache font::glyphs(DEFAULT_GLYPH_CACHE_SIZE);
+
+void font::draw_bitmap(const glyph_t *const bitmap, const int target_height, const FT_Int x, const FT_Int y, uint8_t r, uint8_t g, uint8_t b, const bool invert, const bool underline, const bool rainbow)
 {
 #if 0
 	assert(x >= 0);
@@ -37,7 +46,7 @@ void font::draw_bitmap(const FT_Bitmap *const bitmap, const int target_height, c
 				b = db * 255.0;
 			}
 
-			for(unsigned int xo=0; xo<bitmap->width; xo++)
+			for(int xo=0; xo<bitmap -> bitmap_w; xo++)
 			{
 				int o = yo * w * 3 + (x + xo) * 3;
 
@@ -51,7 +60,7 @@ void font::draw_bitmap(const FT_Bitmap *const bitmap, const int target_height, c
 		}
 	}
 
-	for(unsigned int yo=0; yo<bitmap->rows; yo++)
+	for(int yo=0; yo<bitmap -> bitmap_h; yo++)
 	{
 		int yu = yo + y;
 
@@ -64,13 +73,13 @@ void font::draw_bitmap(const FT_Bitmap *const bitmap, const int target_height, c
 		if (rainbow)
 		{
 			double dr = 0, dg = 0, db = 0;
-			hls_to_rgb(double(yo) / double(bitmap -> rows), 0.5, 0.5, &dr, &dg, &db);
+			hls_to_rgb(double(yo) / double(bitmap -> bitmap_h), 0.5, 0.5, &dr, &dg, &db);
 			r = dr * 255.0;
 			g = dg * 255.0;
 			b = db * 255.0;
 		}
 
-		for(unsigned int xo=0; xo<bitmap->width; xo++)
+		for(int xo=0; xo<bitmap -> bitmap_w; xo++)
 		{
 			int xu = xo + x;
 
@@ -82,7 +91,7 @@ void font::draw_bitmap(const FT_Bitmap *const bitmap, const int target_height, c
 
 			int o = yu * w * 3 + xu * 3;
 
-			int pixel_v = bitmap->buffer[yo * bitmap->width + xo];
+			int pixel_v = bitmap -> coverage[yo * bitmap -> bitmap_w + xo];
 
 			if (invert)
 				pixel_v = 255 - pixel_v;
@@ -104,7 +113,7 @@ void font::draw_bitmap(const FT_Bitmap *const bitmap, const int target_height, c
 
 		for(int y=0; y<u_height; y++)
 		{
-			for(unsigned int xo=0; xo<bitmap->width; xo++)
+			for(int xo=0; xo<bitmap -> bitmap_w; xo++)
 			{
 				int o = (h - (1 + y)) * w * 3 + (x + xo) * 3;
 
@@ -121,45 +130,180 @@ void font::draw_bitmap(const FT_Bitmap *const bitmap, const int target_height, c
 
 void font::init_fonts()
 {
-	FT_Init_FreeType(&font::library);
+	rescan_fonts();
 }
 
+// no render may be running
 void font::uninit_fonts()
 {
-	pthread_mutex_lock(&freetype2_lock);
+	pthread_mutex_lock(&contexts_lock);
+
+	for(size_t i=0; i<contexts.size(); i++)
+	{
+		ft_context_t *const ctx = contexts.at(i);
+
+		std::map<std::string, FT_Face>::iterator it = ctx -> faces.begin();
+
+		for(; it != ctx -> faces.end(); it++)
+			FT_Done_Face(it -> second);
+
+		FT_Done_FreeType(ctx -> library);
 
-	std::map<std::string, FT_Face>::iterator it = font_cache.begin();
+		delete ctx;
+	}
+
+	contexts.clear();
+	free_contexts.clear();
+
+	pthread_mutex_unlock(&contexts_lock);
+
+	pthread_mutex_lock(&fontconfig_lock);
 
-	while(it != font_cache.end())
-		FT_Done_Face(it -> second);
+	if (fc_config)
+		FcConfigDestroy(fc_config);
+	fc_config = NULL;
 
-	FT_Done_FreeType(font::library);
+	font_name_cache.clear();
 
-	pthread_mutex_unlock(&freetype2_lock);
+	pthread_mutex_unlock(&fontconfig_lock);
+}
+
+void font::set_glyph_cache_size(const size_t bytes)
+{
+	glyphs.set_max_bytes(bytes);
+}
+
+void font::get_glyph_cache_stats(glyph_cache_stats_t *const stats)
+{
+	glyphs.get_stats(stats);
+}
+
+int font::get_n_contexts()
+{
+	pthread_mutex_lock(&contexts_lock);
+	const int n = contexts.size();
+	pthread_mutex_unlock(&contexts_lock);
+
+	return n;
+}
+
+// a free context, or a new one when all are in use
+ft_context_t *font::get_context()
+{
+	pthread_mutex_lock(&contexts_lock);
+
+	if (!free_contexts.empty())
+	{
+		ft_context_t *const ctx = free_contexts.back();
+		free_contexts.pop_back();
+
+		pthread_mutex_unlock(&contexts_lock);
+
+		return ctx;
+	}
+
+	pthread_mutex_unlock(&contexts_lock);
+
+	ft_context_t *ctx = new ft_context_t;
+
+	if (FT_Init_FreeType(&ctx -> library))
+	{
+		delete ctx;
+
+		throw std::string("cannot initialize freetype");
+	}
+
+	pthread_mutex_lock(&contexts_lock);
+
+	contexts.push_back(ctx);
+	// never grows while a context is given back
+	free_contexts.reserve(contexts.size());
+
+	pthread_mutex_unlock(&contexts_lock);
+
+	return ctx;
+}
+
+void font::put_context(ft_context_t *const ctx)
+{
+	pthread_mutex_lock(&contexts_lock);
+
+	free_contexts.push_back(ctx);
+
+	pthread_mutex_unlock(&contexts_lock);
+}
+
+// face belongs to a context taken by the caller
+glyph_ptr_t font::get_glyph(FT_Face face, const int font_id, const int target_height, const unsigned int glyph_index, const bool antialias)
+{
+	glyph_ptr_t cached = glyphs.lookup(font_id, target_height, glyph_index, antialias);
+	if (cached)
+		return cached;
+
+	if (FT_Load_Glyph(face, glyph_index, FT_LOAD_RENDER | (antialias ? 0 : FT_LOAD_MONOCHROME | FT_LOAD_TARGET_MONO)))
+		return cached;
+
+	const FT_GlyphSlot slot = face -> glyph;
+	const FT_Bitmap *const bitmap = &slot -> bitmap;
+
+	glyph_t *g = new glyph_t;
+	g -> advance = slot -> metrics.horiAdvance;
+	g -> bearing_y = slot -> metrics.horiBearingY;
+	g -> height = slot -> metrics.height;
+	g -> left = slot -> bitmap_left;
+	g -> top = slot -> bitmap_top;
+	g -> bitmap_w = bitmap -> width;
+	g -> bitmap_h = bitmap -> rows;
+	g -> coverage = new uint8_t[g -> bitmap_w * g -> bitmap_h];
+
+	// store as one byte per pixel, whatever freetype produced
+	for(int y=0; y<g -> bitmap_h; y++)
+	{
+		const uint8_t *const row = &bitmap -> buffer[y * bitmap -> pitch];
+		uint8_t *const out = &g -> coverage[y * g -> bitmap_w];
+
+		if (bitmap -> pixel_mode == FT_PIXEL_MODE_MONO)
+		{
+			for(int x=0; x<g -> bitmap_w; x++)
+				out[x] = (row[x >> 3] & (0x80 >> (x & 7))) ? 255 : 0;
+		}
+		else
+		{
+			memcpy(out, row, g -> bitmap_w);
+		}
+	}
+
+	return glyphs.store(font_id, target_height, glyph_index, antialias, g);
 }
 
 font::font(const std::string & filename, const std::string & text, const int target_height, const bool antialias) {
-	// this sucks a bit but apparently freetype2 is not thread safe
-	pthread_mutex_lock(&freetype2_lock);
+	// freetype is not thread safe, but separate libraries can be used at the same time
+	context_guard guard;
+	ft_context_t *const ctx = guard.ctx;
 
 	result = NULL;
 
 	FT_Face face = NULL;
-	std::map<std::string, FT_Face>::iterator it = font_cache.find(filename);
-	if (it == font_cache.end())
+	std::map<std::string, FT_Face>::iterator it = ctx -> faces.find(filename);
+	if (it == ctx -> faces.end())
 	{
-		if (FT_New_Face(library, filename.c_str(), 0, &face))
+		stats_count(CNT_FACE_MISSES);
+
+		if (FT_New_Face(ctx -> library, filename.c_str(), 0, &face))
 			throw std::string("cannot open font file ") + filename;
 
-		font_cache.insert(std::pair<std::string, FT_Face>(filename, face));
+		ctx -> faces.insert(std::pair<std::string, FT_Face>(filename, face));
 	}
 	else
 	{
+		stats_count(CNT_FACE_HITS);
+
 		face = it -> second;
 	}
 
+	const int font_id = glyphs.get_font_id(filename);
+
 	FT_Set_Char_Size(face, target_height * 64, target_height * 64, 72, 72); /* set character size */
-	FT_GlyphSlot slot = face->glyph;
 
 	w = 0;
 
@@ -204,25 +348,25 @@ just_draw1:
 				w += akern.x;
 		}
 
-		if (FT_Load_Glyph(face, glyph_index, FT_LOAD_RENDER | (antialias ? 0 : FT_LOAD_MONOCHROME)))
+		glyph_ptr_t g = get_glyph(face, font_id, target_height, glyph_index, antialias);
+		if (!g)
 		{
 			n++;
 			continue;
 		}
 
-		w += face -> glyph -> metrics.horiAdvance;
+		w += g -> advance;
 
-		max_ascender = std::max(max_ascender, int(face -> glyph -> metrics.horiBearingY));
-		max_descender = std::max(max_descender, int(face -> glyph -> metrics.height - face -> glyph -> metrics.horiBearingY));
+		max_ascender = std::max(max_ascender, g -> bearing_y);
+		max_descender = std::max(max_descender, g -> height - g -> bearing_y);
 
 #ifdef DEBUG
-		printf("char %c w×h = %.1fx%.1f ascender %.1f bearingx %.1f bitmap: %dx%d left/top: %d,%d akern %ld,%ld\n",
+		printf("char %c w×h = %.1fx%.1f ascender %.1f bitmap: %dx%d left/top: %d,%d akern %ld,%ld\n",
 				c,
-				face -> glyph -> metrics.horiAdvance / 64.0, face -> glyph -> metrics.height / 64.0, // wxh
-				face -> glyph -> metrics.horiBearingY / 64.0, // ascender
-				face -> glyph -> metrics.horiBearingX / 64.0, // bearingx
-				face -> glyph -> bitmap.width, face -> glyph -> bitmap.rows, // bitmap wxh
-				face -> glyph -> bitmap_left, face -> glyph -> bitmap_top,
+				g -> advance / 64.0, g -> height / 64.0, // wxh
+				g -> bearing_y / 64.0, // ascender
+				g -> bitmap_w, g -> bitmap_h, // bitmap wxh
+				g -> left, g -> top,
 				akern.x, akern.y);
 #endif
 
@@ -243,7 +387,7 @@ just_draw1:
 
 	// target_height!!
 	bytes = w * target_height * 3;
-	result = new uint8_t[bytes];
+	result = pixel_buffers.get(bytes);
 	memset(result, 0x00, bytes);
 
 	uint8_t color_r = 0xff, color_g = 0xff, color_b = 0xff;
@@ -295,27 +439,26 @@ just_draw2:
 			x += akern.x;
 		}
 
-		if (FT_Load_Glyph(face, glyph_index, FT_LOAD_RENDER))
+		glyph_ptr_t g = get_glyph(face, font_id, target_height, glyph_index, antialias);
+		if (!g)
 		{
 			n++;
 			continue;
 		}
 
-		draw_bitmap(&slot->bitmap, target_height, x / 64.0, max_ascender / 64.0 - slot -> bitmap_top, color_r, color_g, color_b, invert, underline, rainbow);
+		draw_bitmap(g.get(), target_height, x / 64.0, max_ascender / 64.0 - g -> top, color_r, color_g, color_b, invert, underline, rainbow);
 
-		x += face -> glyph -> metrics.horiAdvance;
+		x += g -> advance;
 
 		prev_glyph_index = glyph_index;
 
 		n++;
 	}
-
-	pthread_mutex_unlock(&freetype2_lock);
 }
 
 font::~font()
 {
-	delete [] result;
+	pixel_buffers.put(result, bytes);
 }
 
 void font::getImage(int *const w, uint8_t **const p, bool *flash_requested) const
@@ -330,28 +473,58 @@ int font::getMaxAscender() const
 	return max_ascender;
 }
 
+// (re-)load the fontconfig configuration, e.g. after fonts were installed
+void rescan_fonts()
+{
+	// scanning is slow: do it before taking the lock
+	FcConfig *new_config = FcInitLoadConfigAndFonts();
+
+	pthread_mutex_lock(&fontconfig_lock);
+
+	if (fc_config)
+		FcConfigDestroy(fc_config);
+
+	fc_config = new_config;
+
+	font_name_cache.clear();
+
+	pthread_mutex_unlock(&fontconfig_lock);
+}
+
 // from http://stackoverflow.com/questions/10542832/how-to-use-fontconfig-to-get-font-list-c-c
 std::string find_font_by_name(const std::string & font_name, const std::string & default_font_file)
 {
-	std::string fontFile = default_font_file;
+	std::string fontFile;
 
 	pthread_mutex_lock(&fontconfig_lock);
 
-	FcConfig* config = FcInitLoadConfigAndFonts();
+	std::unordered_map<std::string, std::string>::iterator it = font_name_cache.find(font_name);
+	if (it != font_name_cache.end())
+	{
+		stats_count(CNT_FONT_NAME_HITS);
+
+		fontFile = it -> second;
+
+		pthread_mutex_unlock(&fontconfig_lock);
+
+		return fontFile.empty() ? default_font_file : fontFile;
+	}
+
+	stats_count(CNT_FONT_NAME_MISSES);
 
 	// configure the search pattern, 
 	// assume "name" is a std::string with the desired font name in it
 	FcPattern* pat = FcNameParse((const FcChar8*)(font_name.c_str()));
 
-	if (pat)
+	if (pat && fc_config)
 	{
-		if (FcConfigSubstitute(config, pat, FcMatchPattern))
+		if (FcConfigSubstitute(fc_config, pat, FcMatchPattern))
 		{
 			FcDefaultSubstitute(pat);
 
 			// find the font
 			FcResult result = FcResultNoMatch;
-			FcPattern* font = FcFontMatch(config, pat, &result);
+			FcPattern* font = FcFontMatch(fc_config, pat, &result);
 			if (font)
 			{
 				FcChar8* file = NULL;
@@ -364,13 +537,17 @@ std::string find_font_by_name(const std::string & font_name, const std::string &
 				FcPatternDestroy(font);
 			}
 		}
+	}
 
+	if (pat)
 		FcPatternDestroy(pat);
-	}
+
+	// also remember misses, those would otherwise be looked up over and over again
+	font_name_cache.insert(std::pair<std::string, std::string>(font_name, fontFile));
 
 	pthread_mutex_unlock(&fontconfig_lock);
 
-	return fontFile;
+	return fontFile.empty() ? default_font_file : fontFile;
 }
 
 #if defined(DEBUG) || defined(DEBUG_IMG)
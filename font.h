@@ -1,22 +1,46 @@
 #include <map>
 #include <stdint.h>
 #include <string>
+#include <vector>
 
 #include <freetype2/ft2build.h>
 #include FT_FREETYPE_H
 
+#include "glyph_cache.h"
+
 #define DEFAULT_FONT_FILE "/usr/share/fonts/truetype/msttcorefonts/Verdana.ttf"
 
+// a freetype library and the faces opened in it; freetype is only thread
+// safe per library, so a context is used by one render at a time
+typedef struct {
+	FT_Library library;
+	std::map<std::string, FT_Face> faces;
+} ft_context_t;
+
 class font {
 private:
-	static FT_Library library;
-	static std::map<std::string, FT_Face> font_cache;
+	// as many as there were renders at the same time
+	static std::vector<ft_context_t *> contexts, free_contexts;
+	static glyph_cache glyphs;
+
+	static ft_context_t *get_context();
+	static void put_context(ft_context_t *const ctx);
+
+	// a context that is given back however the render ends
+	class context_guard {
+	public:
+		ft_context_t *const ctx;
+
+		context_guard() : ctx(get_context()) { }
+		~context_guard() { put_context(ctx); }
+	};
 
 	uint8_t *result;
 	int bytes, w, h, max_ascender;
 	bool want_flash;
 
-	void draw_bitmap(const FT_Bitmap *const bitmap, const int target_height, const FT_Int x, const FT_Int y, uint8_t r, uint8_t g, uint8_t b, const bool invert, const bool underline, const bool rainbow);
+	static glyph_ptr_t get_glyph(FT_Face face, const int font_id, const int target_height, const unsigned int glyph_index, const bool antialias);
+	void draw_bitmap(const glyph_t *const bitmap, const int target_height, const FT_Int x, const FT_Int y, uint8_t r, uint8_t g, uint8_t b, const bool invert, const bool underline, const bool rainbow);
 
 public:
 	font(const std::string & filename, const std::string & text, const int target_height, const bool antialias);
@@ -27,6 +51,11 @@ public:
 
 	static void init_fonts();
 	static void uninit_fonts();
+
+	static void set_glyph_cache_size(const size_t bytes);
+	static void get_glyph_cache_stats(glyph_cache_stats_t *const stats);
+	static int get_n_contexts();
 };
 
+void rescan_fonts();
 std::string find_font_by_name(const std::string & font_name, const std::string & default_font_file);
@@ -0,0 +1,120 @@
+#include <algorithm>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+#include "frame_pacer.h"
+#include "stats.h"
+
+frame_pacer::frame_pacer(const int fps, const pacing_policy_t policy_in) : period_ns(fps > 0 ? 1000000000ll / fps : 0), policy(policy_in), max_catch_up(fps / 2 + 1), prev_frame_start(-1)
+{
+	pthread_mutex_init(&lock, NULL);
+
+	memset(hist, 0x00, sizeof hist);
+	memset(&stats, 0x00, sizeof stats);
+	stats.target_us = period_ns / 1000;
+
+	reset();
+}
+
+frame_pacer::~frame_pacer()
+{
+	pthread_mutex_destroy(&lock);
+}
+
+void frame_pacer::reset()
+{
+	deadline = frame_start = get_mono_ns();
+	prev_frame_start = -1;
+}
+
+void frame_pacer::begin_frame()
+{
+	frame_start = get_mono_ns();
+
+	if (prev_frame_start != -1) {
+		const int us = (frame_start - prev_frame_start) / 1000;
+
+		pthread_mutex_lock(&lock);
+		hist[std::min(us / FRAME_HIST_BUCKET_US, FRAME_HIST_BUCKETS)]++;
+
+		if (us > stats.max_us)
+			stats.max_us = us;
+		pthread_mutex_unlock(&lock);
+	}
+
+	prev_frame_start = frame_start;
+}
+
+void frame_pacer::end_frame()
+{
+	const int64_t now = get_mono_ns();
+	const int busy_us = (now - frame_start) / 1000;
+
+	deadline += period_ns;
+
+	uint64_t late = 0, dropped = 0;
+
+	if (period_ns > 0 && now > deadline) {
+		late = 1;
+
+		const int64_t behind = (now - deadline) / period_ns;
+
+		// PACE_CATCH_UP leaves the deadline in the past so that the next
+		// frames follow without sleeping, unless that would take too long
+		if (policy == PACE_SKIP || behind >= max_catch_up) {
+			dropped = behind + 1;
+			deadline += dropped * period_ns;
+		}
+	}
+
+	pthread_mutex_lock(&lock);
+	stats.frames++;
+	stats.late += late;
+	stats.dropped += dropped;
+
+	if (busy_us > stats.max_busy_us)
+		stats.max_busy_us = busy_us;
+	pthread_mutex_unlock(&lock);
+
+	// no frame rate limit
+	if (period_ns == 0)
+		return;
+
+	struct timespec ts;
+	ts.tv_sec = deadline / 1000000000ll;
+	ts.tv_nsec = deadline % 1000000000ll;
+
+	while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+	}
+}
+
+void frame_pacer::get_stats(frame_stats_t *const out)
+{
+	pthread_mutex_lock(&lock);
+
+	*out = stats;
+
+	uint64_t n = 0;
+	for(int i=0; i<=FRAME_HIST_BUCKETS; i++)
+		n += hist[i];
+
+	const uint64_t n50 = (n * 50 + 99) / 100, n99 = (n * 99 + 99) / 100;
+
+	uint64_t seen = 0;
+	for(int i=0; i<=FRAME_HIST_BUCKETS && seen < n99; i++) {
+		if (hist[i] == 0)
+			continue;
+
+		// report the upper end of the bucket
+		if (seen < n50 && seen + hist[i] >= n50)
+			out -> p50_us = std::min((i + 1) * FRAME_HIST_BUCKET_US, stats.max_us);
+
+		seen += hist[i];
+
+		if (seen >= n99)
+			out -> p99_us = std::min((i + 1) * FRAME_HIST_BUCKET_US, stats.max_us);
+	}
+
+	pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,56 @@
+#ifndef __FRAME_PACER_H__
+#define __FRAME_PACER_H__
+
+#include <pthread.h>
+#include <stdint.h>
+
+// frame times are collected in buckets of this size (in microseconds)
+#define FRAME_HIST_BUCKET_US 100
+#define FRAME_HIST_BUCKETS 5000
+
+// what to do when composing a frame took longer than the frame period
+typedef enum {
+	// continue at the next deadline on the grid, the missed frames are dropped
+	PACE_SKIP,
+	// run the missed frames back-to-back (at most max_catch_up of them)
+	PACE_CATCH_UP
+} pacing_policy_t;
+
+typedef struct {
+	uint64_t frames, late, dropped;
+	// time between the starts of two frames
+	int p50_us, p99_us, max_us;
+	// time spent composing and pushing a frame
+	int max_busy_us;
+	int target_us;
+} frame_stats_t;
+
+// paces the compositor on absolute CLOCK_MONOTONIC deadlines
+class frame_pacer {
+private:
+	const int64_t period_ns;
+	const pacing_policy_t policy;
+	const int max_catch_up;
+
+	int64_t deadline, frame_start, prev_frame_start;
+
+	pthread_mutex_t lock;
+	uint32_t hist[FRAME_HIST_BUCKETS + 1];
+	frame_stats_t stats;
+
+public:
+	// fps 0 runs frames back-to-back
+	frame_pacer(const int fps, const pacing_policy_t policy_in);
+	virtual ~frame_pacer();
+
+	// starts a new grid at "now", e.g. after the display was off
+	void reset();
+
+	void begin_frame();
+	// sleeps until the deadline of the next frame
+	void end_frame();
+
+	void get_stats(frame_stats_t *const out);
+};
+
+#endif
@@ -0,0 +1,63 @@
+#include <algorithm>
+#include <string.h>
+
+#include "frame_pusher.h"
+
+frame_pusher::frame_pusher(const int w_in, const int h_in, const int brightness_in) : brightness(-1), shadow_valid(false), w(w_in), h(h_in)
+{
+	shadow = new uint8_t[w * h * 3];
+
+	set_brightness(brightness_in);
+}
+
+frame_pusher::~frame_pusher()
+{
+	delete [] shadow;
+}
+
+bool frame_pusher::set_brightness(const int brightness_in)
+{
+	if (brightness_in == brightness)
+		return false;
+
+	brightness = brightness_in;
+
+	for(int i=0; i<256; i++)
+		lut[i] = std::min(255, std::max(0, (i * brightness) / 100));
+
+	return true;
+}
+
+void frame_pusher::invalidate()
+{
+	shadow_valid = false;
+}
+
+void frame_pusher::push(rgb_matrix::Canvas *const c, const uint8_t *const data, const rect_t & r)
+{
+	const int x1 = std::min(r.x + r.w, std::min(w, c -> width()));
+	const int y1 = std::min(r.y + r.h, std::min(h, c -> height()));
+
+	for(int y=r.y; y<y1; y++) {
+		const uint8_t *in = &data[(y * w + r.x) * 3];
+		uint8_t *out = &shadow[(y * w + r.x) * 3];
+
+		for(int x=r.x; x<x1; x++, in += 3, out += 3) {
+			const uint8_t pr = lut[in[0]], pg = lut[in[1]], pb = lut[in[2]];
+
+			// SetPixel() is a virtual call doing the bit-plane work: avoid it when possible
+			if (shadow_valid && out[0] == pr && out[1] == pg && out[2] == pb)
+				continue;
+
+			out[0] = pr;
+			out[1] = pg;
+			out[2] = pb;
+
+			c -> SetPixel(x, y, pr, pg, pb);
+		}
+	}
+
+	// only the whole screen makes the shadow complete again
+	if (r.x == 0 && r.y == 0 && x1 == std::min(w, c -> width()) && y1 == std::min(h, c -> height()))
+		shadow_valid = true;
+}
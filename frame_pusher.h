@@ -0,0 +1,33 @@
+#ifndef __FRAME_PUSHER_H__
+#define __FRAME_PUSHER_H__
+
+#include <stdint.h>
+
+#include "canvas.h"
+#include "damage.h"
+
+// copies (parts of) the frame buffer to the canvas, applying the brightness
+class frame_pusher {
+private:
+	uint8_t lut[256];
+	int brightness;
+
+	// what the canvas shows right now, so unchanged pixels can be skipped
+	uint8_t *shadow;
+	bool shadow_valid;
+	const int w, h;
+
+public:
+	frame_pusher(const int w_in, const int h_in, const int brightness_in);
+	virtual ~frame_pusher();
+
+	// returns true when it changed: everything then needs to be pushed again
+	bool set_brightness(const int brightness_in);
+
+	// call after the canvas was modified directly (Clear(), Fill())
+	void invalidate();
+
+	void push(rgb_matrix::Canvas *const c, const uint8_t *const data, const rect_t & r);
+};
+
+#endif
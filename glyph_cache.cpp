@@ -0,0 +1,143 @@
+#include "glyph_cache.h"
+
+static void delete_glyph(const glyph_t *g)
+{
+	delete [] g -> coverage;
+	delete g;
+}
+
+glyph_cache::glyph_cache(const size_t max_bytes_in) : bytes(0), max_bytes(max_bytes_in), hits(0), misses(0), evictions(0)
+{
+	pthread_mutex_init(&lock, NULL);
+}
+
+glyph_cache::~glyph_cache()
+{
+	pthread_mutex_destroy(&lock);
+}
+
+uint64_t glyph_cache::make_key(const int font_id, const int height, const unsigned int glyph_index, const bool antialias)
+{
+	// font id: 16 bits, height: 15 bits, antialias: 1 bit, glyph index: 32 bits
+	return (uint64_t(font_id & 0xffff) << 48) | (uint64_t(height & 0x7fff) << 33) | (uint64_t(antialias) << 32) | glyph_index;
+}
+
+int glyph_cache::get_font_id(const std::string & filename)
+{
+	pthread_mutex_lock(&lock);
+
+	int id = 0;
+
+	std::map<std::string, int>::iterator it = font_ids.find(filename);
+	if (it == font_ids.end())
+	{
+		id = font_ids.size();
+		font_ids.insert(std::pair<std::string, int>(filename, id));
+	}
+	else
+	{
+		id = it -> second;
+	}
+
+	pthread_mutex_unlock(&lock);
+
+	return id;
+}
+
+glyph_ptr_t glyph_cache::lookup(const int font_id, const int height, const unsigned int glyph_index, const bool antialias)
+{
+	const uint64_t key = make_key(font_id, height, glyph_index, antialias);
+
+	glyph_ptr_t result;
+
+	pthread_mutex_lock(&lock);
+
+	std::unordered_map<uint64_t, std::list<entry_t>::iterator>::iterator it = index.find(key);
+	if (it == index.end())
+	{
+		misses++;
+	}
+	else
+	{
+		hits++;
+
+		// move to the front of the lru
+		lru.splice(lru.begin(), lru, it -> second);
+
+		result = it -> second -> g;
+	}
+
+	pthread_mutex_unlock(&lock);
+
+	return result;
+}
+
+glyph_ptr_t glyph_cache::store(const int font_id, const int height, const unsigned int glyph_index, const bool antialias, glyph_t *const g)
+{
+	const uint64_t key = make_key(font_id, height, glyph_index, antialias);
+
+	glyph_ptr_t result(g, delete_glyph);
+
+	pthread_mutex_lock(&lock);
+
+	std::unordered_map<uint64_t, std::list<entry_t>::iterator>::iterator it = index.find(key);
+	if (it != index.end())
+	{
+		// someone else rendered it in the mean time
+		result = it -> second -> g;
+	}
+	else
+	{
+		entry_t e = { key, result, sizeof(glyph_t) + sizeof(entry_t) + g -> bitmap_w * g -> bitmap_h };
+
+		lru.push_front(e);
+		index.insert(std::pair<uint64_t, std::list<entry_t>::iterator>(key, lru.begin()));
+
+		bytes += e.bytes;
+
+		evict();
+	}
+
+	pthread_mutex_unlock(&lock);
+
+	return result;
+}
+
+// lock must be held; glyphs still in use by a renderer stay alive via their glyph_ptr_t
+void glyph_cache::evict()
+{
+	while(bytes > max_bytes && !lru.empty())
+	{
+		entry_t & e = lru.back();
+
+		bytes -= e.bytes;
+		index.erase(e.key);
+		lru.pop_back();
+
+		evictions++;
+	}
+}
+
+void glyph_cache::set_max_bytes(const size_t max_bytes_in)
+{
+	pthread_mutex_lock(&lock);
+
+	max_bytes = max_bytes_in;
+	evict();
+
+	pthread_mutex_unlock(&lock);
+}
+
+void glyph_cache::get_stats(glyph_cache_stats_t *const stats)
+{
+	pthread_mutex_lock(&lock);
+
+	stats -> hits = hits;
+	stats -> misses = misses;
+	stats -> evictions = evictions;
+	stats -> n_glyphs = index.size();
+	stats -> bytes = bytes;
+	stats -> max_bytes = max_bytes;
+
+	pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,64 @@
+#ifndef __GLYPH_CACHE_H__
+#define __GLYPH_CACHE_H__
+
+#include <list>
+#include <map>
+#include <memory>
+#include <pthread.h>
+#include <stdint.h>
+#include <string>
+#include <unordered_map>
+
+#define DEFAULT_GLYPH_CACHE_SIZE (4 * 1024 * 1024)
+
+// a rendered glyph; metrics are in 26.6 fixed point like freetype returns them
+typedef struct {
+	int advance, bearing_y, height;
+	int left, top;
+	int bitmap_w, bitmap_h;
+	uint8_t *coverage; // bitmap_w * bitmap_h bytes, 0...255, also for monochrome glyphs
+} glyph_t;
+
+typedef std::shared_ptr<const glyph_t> glyph_ptr_t;
+
+typedef struct {
+	uint64_t hits, misses, evictions;
+	size_t n_glyphs, bytes, max_bytes;
+} glyph_cache_stats_t;
+
+// rasterized glyphs of all fonts, evicted least-recently-used-first when over the memory cap
+class glyph_cache {
+private:
+	typedef struct {
+		uint64_t key;
+		glyph_ptr_t g;
+		size_t bytes;
+	} entry_t;
+
+	std::list<entry_t> lru; // front is most recently used
+	std::unordered_map<uint64_t, std::list<entry_t>::iterator> index;
+	std::map<std::string, int> font_ids;
+
+	size_t bytes, max_bytes;
+	uint64_t hits, misses, evictions;
+
+	pthread_mutex_t lock;
+
+	static uint64_t make_key(const int font_id, const int height, const unsigned int glyph_index, const bool antialias);
+	void evict();
+
+public:
+	glyph_cache(const size_t max_bytes_in);
+	virtual ~glyph_cache();
+
+	int get_font_id(const std::string & filename);
+
+	glyph_ptr_t lookup(const int font_id, const int height, const unsigned int glyph_index, const bool antialias);
+	// takes ownership of g (and its coverage buffer)
+	glyph_ptr_t store(const int font_id, const int height, const unsigned int glyph_index, const bool antialias, glyph_t *const g);
+
+	void set_max_bytes(const size_t max_bytes_in);
+	void get_stats(glyph_cache_stats_t *const stats);
+};
+
+#endif
@@ -0,0 +1,428 @@
+// load generator: sends add_text, replace and stop commands to a running
+// matrix-server at a fixed rate and reports how long it took until the
+// texts were on the display, using the trace hook of the server
+//
+// both must run on the same host: the timestamps of the server are
+// compared against CLOCK_MONOTONIC here
+#include <algorithm>
+#include <errno.h>
+#include <jansson.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include "binary_command.h"
+#include "error.h"
+#include "stats.h"
+#include "utils.h"
+
+// how often the finished traces are collected
+#define POLL_INTERVAL_MS 100
+
+typedef enum { OP_ADD, OP_REPLACE, OP_STOP, N_OPS } op_t;
+
+typedef struct {
+	uint32_t trace;
+	int64_t received_ns, composed_ns, pushed_ns;
+} result_t;
+
+typedef struct {
+	std::string host;
+	int port;
+
+	pthread_mutex_t lock;
+	std::vector<result_t> results;
+	uint64_t dropped;
+
+	volatile bool stop;
+} poller_t;
+
+int connect_to(const std::string & host, const int port, const int type)
+{
+	struct addrinfo hints, *res = NULL;
+	memset(&hints, 0x00, sizeof hints);
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = type;
+
+	int rc = getaddrinfo(host.c_str(), format("%d", port).c_str(), &hints, &res);
+	if (rc != 0)
+		error_exit(false, "cannot resolve %s: %s", host.c_str(), gai_strerror(rc));
+
+	int fd = socket(res -> ai_family, res -> ai_socktype, res -> ai_protocol);
+	if (fd == -1)
+		error_exit(true, "cannot create socket");
+
+	if (connect(fd, res -> ai_addr, res -> ai_addrlen) == -1)
+		error_exit(true, "cannot connect to %s port %d", host.c_str(), port);
+
+	freeaddrinfo(res);
+
+	return fd;
+}
+
+void write_all(const int fd, const std::string & data)
+{
+	for(size_t done = 0; done < data.size();)
+	{
+		int rc = write(fd, data.data() + done, data.size() - done);
+
+		if (rc == -1)
+		{
+			if (errno == EINTR)
+				continue;
+
+			error_exit(true, "write failed");
+		}
+
+		done += rc;
+	}
+}
+
+std::string read_line(const int fd)
+{
+	std::string line;
+	char c = 0;
+
+	for(;;)
+	{
+		int rc = read(fd, &c, 1);
+
+		if (rc == -1 && errno == EINTR)
+			continue;
+
+		if (rc <= 0)
+			error_exit(rc == -1, "connection to the server closed");
+
+		if (c == '\n')
+			return line;
+
+		line += c;
+	}
+}
+
+// asks for the finished traces over a tcp connection of its own
+void poll_traces(poller_t *const p, const int fd)
+{
+	write_all(fd, "{\"cmd\":\"trace\"}\n");
+
+	std::string line = read_line(fd);
+
+	json_error_t error;
+	json_t *obj = json_loads(line.c_str(), 0, &error);
+	if (!obj)
+		error_exit(false, "reply to trace does not parse: %s", error.text);
+
+	const json_t *const list = json_object_get(obj, "traces");
+
+	pthread_mutex_lock(&p -> lock);
+
+	for(size_t i=0; i<json_array_size(list); i++)
+	{
+		const json_t *const entry = json_array_get(list, i);
+
+		result_t r;
+		r.trace = json_integer_value(json_array_get(entry, 0));
+		r.received_ns = json_integer_value(json_array_get(entry, 1));
+		r.composed_ns = json_integer_value(json_array_get(entry, 2));
+		r.pushed_ns = json_integer_value(json_array_get(entry, 3));
+
+		p -> results.push_back(r);
+	}
+
+	p -> dropped += json_integer_value(json_object_get(obj, "dropped"));
+
+	pthread_mutex_unlock(&p -> lock);
+
+	json_decref(obj);
+}
+
+void *poller_thread(void *arg)
+{
+	poller_t *const p = (poller_t *)arg;
+
+	int fd = connect_to(p -> host, p -> port, SOCK_STREAM);
+
+	while(!p -> stop)
+	{
+		poll_traces(p, fd);
+
+		usleep(POLL_INTERVAL_MS * 1000);
+	}
+
+	// what came in after the last command
+	poll_traces(p, fd);
+
+	close(fd);
+
+	return NULL;
+}
+
+void sleep_until(const int64_t ts_ns)
+{
+	struct timespec ts;
+	ts.tv_sec = ts_ns / 1000000000ll;
+	ts.tv_nsec = ts_ns % 1000000000ll;
+
+	while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+	{
+	}
+}
+
+double percentile(const std::vector<int64_t> & sorted, const double p)
+{
+	if (sorted.empty())
+		return 0;
+
+	size_t idx = std::min(sorted.size() - 1, size_t(p / 100.0 * sorted.size()));
+
+	return sorted.at(idx) / 1000000.0;
+}
+
+void print_latency(const char *const name, std::vector<int64_t> *const values)
+{
+	std::sort(values -> begin(), values -> end());
+
+	printf("%-22s %8.2f %8.2f %8.2f %8.2f %8.2f\n", name, percentile(*values, 50), percentile(*values, 90), percentile(*values, 99), percentile(*values, 99.9), values -> empty() ? 0 : values -> back() / 1000000.0);
+}
+
+void help(void)
+{
+	printf("-H <host>      : Host the server runs on. Default: 127.0.0.1\n");
+	printf("-P <port>      : Port of the server. Default: 3333\n");
+	printf("-t             : Send the commands over one tcp connection instead of udp\n");
+	printf("-b             : Send the commands in the binary encoding instead of json\n");
+	printf("-r <rate>      : Commands per second. Default: 100\n");
+	printf("-n <elements>  : Number of different element ids. Default: 10\n");
+	printf("-d <seconds>   : How long to send. Default: 10\n");
+	printf("-m <a:r:s>     : Ratio of adds, replaces (same id, new text) and stops. Default: 10:80:10\n");
+	printf("-G <w>x<h>     : Size of the display. Default: 192x64\n");
+}
+
+int main(int argc, char *argv[])
+{
+	std::string host = "127.0.0.1";
+	int port = 3333, rate = 100, n_elements = 10, duration = 10, w = 192, h = 64;
+	int weights[N_OPS] = { 10, 80, 10 };
+	bool use_tcp = false, use_binary = false;
+
+	int c = -1;
+	while((c = getopt(argc, argv, "H:P:tbr:n:d:m:G:h")) != -1)
+	{
+		switch(c)
+		{
+			case 'H':
+				host = optarg;
+				break;
+
+			case 'P':
+				port = atoi(optarg);
+				break;
+
+			case 't':
+				use_tcp = true;
+				break;
+
+			case 'b':
+				use_binary = true;
+				break;
+
+			case 'r':
+				rate = atoi(optarg);
+				break;
+
+			case 'n':
+				n_elements = atoi(optarg);
+				break;
+
+			case 'd':
+				duration = atoi(optarg);
+				break;
+
+			case 'm':
+				if (sscanf(optarg, "%d:%d:%d", &weights[OP_ADD], &weights[OP_REPLACE], &weights[OP_STOP]) != 3)
+					error_exit(false, "%s is not a valid mix", optarg);
+				break;
+
+			case 'G':
+				if (sscanf(optarg, "%dx%d", &w, &h) != 2 || w < 1 || h < 1)
+					error_exit(false, "%s is not a valid size", optarg);
+				break;
+
+			case 'h':
+				help();
+				return 0;
+
+			default:
+				help();
+				error_exit(false, "option %c is not understood", c);
+		}
+	}
+
+	if (rate < 1 || n_elements < 1 || duration < 1 || weights[OP_ADD] + weights[OP_REPLACE] + weights[OP_STOP] < 1)
+		error_exit(false, "rate, elements, duration and mix must be positive");
+
+	srand(time(NULL));
+
+	poller_t p;
+	p.host = host;
+	p.port = port;
+	pthread_mutex_init(&p.lock, NULL);
+	p.dropped = 0;
+	p.stop = false;
+
+	pthread_t th;
+	pthread_create(&th, NULL, poller_thread, &p);
+
+	int fd = connect_to(host, port, use_tcp ? SOCK_STREAM : SOCK_DGRAM);
+
+	// which ids are on the display, and when each traced command was sent
+	std::vector<bool> active(n_elements, false);
+	int n_active = 0;
+	std::vector<int64_t> sent_ns(1, 0);
+	uint64_t counts[N_OPS] = { 0 }, late = 0;
+
+	const int64_t period = 1000000000ll / rate;
+	const int64_t start = get_mono_ns();
+	const int64_t n_commands = int64_t(rate) * duration;
+
+	for(int64_t i=0; i<n_commands; i++)
+	{
+		const int64_t due = start + i * period;
+
+		if (get_mono_ns() > due + period)
+			late++;
+		else
+			sleep_until(due);
+
+		int pick = rand() % (weights[OP_ADD] + weights[OP_REPLACE] + weights[OP_STOP]);
+		op_t op = pick < weights[OP_ADD] ? OP_ADD : pick < weights[OP_ADD] + weights[OP_REPLACE] ? OP_REPLACE : OP_STOP;
+
+		// turn it into something that is possible right now
+		if (op != OP_ADD && n_active == 0)
+			op = OP_ADD;
+		else if (op == OP_ADD && n_active == n_elements)
+			op = OP_REPLACE;
+
+		// an id that is (not) on the display
+		int id = rand() % n_elements;
+		while(active[id] != (op != OP_ADD))
+			id = (id + 1) % n_elements;
+
+		std::string cmd;
+		const std::string id_str = format("lg%d", id);
+		uint8_t buffer[512];
+
+		if (op == OP_STOP)
+		{
+			if (use_binary)
+				cmd.assign((const char *)buffer, binary_encode_stop(buffer, 0, 0, id_str.c_str()));
+			else
+				cmd = format("{\"cmd\":\"stop\",\"id\":\"%s\"}", id_str.c_str());
+
+			active[id] = false;
+			n_active--;
+		}
+		else
+		{
+			// the same layout for an id, so that a replace only swaps the text
+			const int ew = std::min(w, 64), eh = std::min(h, 16);
+			const int ex = (id * 37) % (w - ew + 1), ey = (id * eh) % (h - eh + 1);
+			const uint32_t trace = sent_ns.size();
+
+			const std::string text = format("load %d/%u", id, trace);
+
+			if (use_binary)
+			{
+				binary_add_text_t bat;
+				memset(&bat, 0x00, sizeof bat);
+				bat.x = ex;
+				bat.y = ey;
+				bat.w = ew;
+				bat.h = eh;
+				bat.pps = 20;
+				bat.z_depth = id % 256;
+				bat.flags = BTF_REPEAT_WRAP | BTF_MOVE_LEFT | BTF_ANTIALIAS;
+				bat.alpha = -1;
+				bat.trace = trace;
+
+				cmd.assign((const char *)buffer, binary_encode_add_text(buffer, 0, 0, bat, id_str.c_str(), NULL, text.c_str()));
+			}
+			else
+			{
+				cmd = format("{\"cmd\":\"add_text\",\"id\":\"%s\",\"x\":%d,\"y\":%d,\"w\":%d,\"h\":%d,\"pps\":20,\"z_depth\":%d,\"prio\":0,\"text\":\"%s\",\"trace\":%u}", id_str.c_str(), ex, ey, ew, eh, id % 256, text.c_str(), trace);
+			}
+
+			if (op == OP_ADD)
+			{
+				active[id] = true;
+				n_active++;
+			}
+
+			sent_ns.push_back(get_mono_ns());
+		}
+
+		counts[op]++;
+
+		if (use_tcp && use_binary)
+		{
+			// binary commands are length prefixed over tcp
+			const uint32_t len = htonl(cmd.size());
+			write_all(fd, std::string((const char *)&len, 4) + cmd);
+		}
+		else if (use_tcp)
+			write_all(fd, cmd + "\n");
+		else if (send(fd, cmd.c_str(), cmd.size(), 0) == -1)
+			error_exit(true, "send failed");
+	}
+
+	const double took = (get_mono_ns() - start) / 1000000000.0;
+
+	// give the last ones a few frames to reach the display
+	usleep(500000);
+
+	p.stop = true;
+	pthread_join(th, NULL);
+
+	close(fd);
+
+	// a text that was replaced or stopped before the compositor got to it is never shown
+	const uint64_t n_traced = sent_ns.size() - 1;
+	std::vector<int64_t> e2e, server, compose;
+
+	for(size_t i=0; i<p.results.size(); i++)
+	{
+		const result_t & r = p.results.at(i);
+
+		if (r.trace == 0 || r.trace > n_traced)
+			continue;
+
+		e2e.push_back(r.pushed_ns - sent_ns.at(r.trace));
+		server.push_back(r.pushed_ns - r.received_ns);
+		compose.push_back(r.composed_ns - r.received_ns);
+	}
+
+	printf("%llu %s commands in %.2fs over %s (%llu add, %llu replace, %llu stop), %llu sent late\n", (unsigned long long)(counts[OP_ADD] + counts[OP_REPLACE] + counts[OP_STOP]), use_binary ? "binary" : "json", took, use_tcp ? "tcp" : "udp", (unsigned long long)counts[OP_ADD], (unsigned long long)counts[OP_REPLACE], (unsigned long long)counts[OP_STOP], (unsigned long long)late);
+	printf("%llu texts traced, %zu shown, %llu replaced or stopped before that, %llu traces dropped by the server\n", (unsigned long long)n_traced, e2e.size(), (unsigned long long)(n_traced - e2e.size()), (unsigned long long)p.dropped);
+
+	if (e2e.empty())
+	{
+		printf("nothing reached the display: is it switched on (kill -USR1 <pid of matrix-server>)?\n");
+
+		return 1;
+	}
+
+	printf("latency in ms               p50      p90      p99    p99.9      max\n");
+	print_latency("sent -> on display", &e2e);
+	print_latency("received -> composed", &compose);
+	print_latency("received -> on display", &server);
+
+	return 0;
+}
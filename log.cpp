@@ -0,0 +1,277 @@
+#include <atomic>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "log.h"
+#include "utils.h"
+
+// threads that can have a ring; messages of any others are dropped
+#define LOG_MAX_THREADS 64
+
+typedef struct {
+	struct timespec ts;
+	log_level_t level;
+	char text[LOG_MSG_SIZE];
+} log_record_t;
+
+// one producer (its thread), one consumer (the log thread)
+typedef struct {
+	log_record_t slots[LOG_RING_SLOTS];
+	std::atomic<uint64_t> head, tail;
+	std::atomic<uint64_t> dropped;
+	pid_t tid;
+	// only touched by the log thread
+	uint64_t dropped_reported;
+	char thread_name[16];
+} log_ring_t;
+
+static const char *const level_names[N_LOG_LEVELS] = { "error", "warning", "info", "debug" };
+
+static std::atomic_int cur_level(LL_INFO);
+static std::atomic_bool started(false), stop_flag(false);
+static pthread_t th;
+
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static log_ring_t *rings[LOG_MAX_THREADS];
+static std::atomic_int n_rings(0);
+static __thread log_ring_t *my_ring = NULL;
+
+static std::atomic<uint64_t> written(0), lost(0);
+
+static void write_record(const log_record_t & r, const char *const thread_name)
+{
+	struct tm tm;
+	localtime_r(&r.ts.tv_sec, &tm);
+
+	// the ones that need attention on stderr, like before
+	FILE *const fh = r.level <= LL_WARNING ? stderr : stdout;
+
+	fprintf(fh, "%04d-%02d-%02d %02d:%02d:%02d.%06ld %-7s %s: %s\n", tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec, r.ts.tv_nsec / 1000, level_names[r.level], thread_name, r.text);
+
+	written++;
+}
+
+static log_ring_t *register_thread()
+{
+	pthread_mutex_lock(&rings_lock);
+
+	log_ring_t *r = NULL;
+	const int n = n_rings;
+
+	if (n < LOG_MAX_THREADS)
+	{
+		r = new log_ring_t;
+		r -> head = r -> tail = 0;
+		r -> dropped = 0;
+		r -> tid = syscall(SYS_gettid);
+		r -> dropped_reported = 0;
+		r -> thread_name[0] = 0x00;
+
+		rings[n] = r;
+		n_rings.store(n + 1, std::memory_order_release);
+	}
+
+	pthread_mutex_unlock(&rings_lock);
+
+	return r;
+}
+
+// works also when the thread is gone already, unlike pthread_getname_np
+static void get_thread_name(const pid_t tid, char *const name, const size_t size)
+{
+	snprintf(name, size, "%d", tid);
+
+	FILE *fh = fopen(format("/proc/self/task/%d/comm", tid).c_str(), "r");
+	if (!fh)
+		return;
+
+	if (fgets(name, size, fh))
+		name[strcspn(name, "\n")] = 0x00;
+
+	fclose(fh);
+}
+
+static void drain()
+{
+	const int n = n_rings.load(std::memory_order_acquire);
+
+	for(int i=0; i<n; i++)
+	{
+		log_ring_t *const r = rings[i];
+
+		const uint64_t head = r -> head.load(std::memory_order_acquire);
+		uint64_t tail = r -> tail.load(std::memory_order_relaxed);
+
+		// looked up here: a thread often gets its name only after it started
+		if (r -> thread_name[0] == 0x00 && tail < head)
+			get_thread_name(r -> tid, r -> thread_name, sizeof r -> thread_name);
+
+		for(; tail < head; tail++)
+			write_record(r -> slots[tail % LOG_RING_SLOTS], r -> thread_name);
+
+		// the slots can be reused
+		r -> tail.store(tail, std::memory_order_release);
+
+		const uint64_t dropped = r -> dropped;
+
+		if (dropped != r -> dropped_reported)
+		{
+			log_record_t lr;
+			clock_gettime(CLOCK_REALTIME, &lr.ts);
+			lr.level = LL_WARNING;
+			snprintf(lr.text, sizeof lr.text, "%llu messages dropped", (unsigned long long)(dropped - r -> dropped_reported));
+
+			write_record(lr, r -> thread_name);
+
+			r -> dropped_reported = dropped;
+		}
+	}
+
+	fflush(stdout);
+	fflush(stderr);
+}
+
+static void *log_thread(void *)
+{
+	while(!stop_flag)
+	{
+		drain();
+
+		usleep(LOG_DRAIN_INTERVAL_US);
+	}
+
+	drain();
+
+	return NULL;
+}
+
+void log_start()
+{
+	if (started)
+		return;
+
+	stop_flag = false;
+
+	pthread_create(&th, NULL, log_thread, NULL);
+	set_thread_name(th, "log");
+
+	started = true;
+}
+
+void log_stop()
+{
+	if (!started)
+		return;
+
+	started = false;
+	stop_flag = true;
+
+	pthread_join(th, NULL);
+}
+
+void log_msg(const log_level_t level, const char *const fmt, ...)
+{
+	if (level > cur_level)
+		return;
+
+	log_record_t *r = NULL, direct;
+	log_ring_t *ring = NULL;
+	uint64_t head = 0;
+
+	if (started)
+	{
+		ring = my_ring;
+
+		if (!ring)
+			ring = my_ring = register_thread();
+
+		if (!ring)
+		{
+			lost++;
+			return;
+		}
+
+		head = ring -> head.load(std::memory_order_relaxed);
+
+		// full: the log thread cannot keep up, and waiting for it is not an option
+		if (head - ring -> tail.load(std::memory_order_acquire) >= LOG_RING_SLOTS)
+		{
+			ring -> dropped++;
+			return;
+		}
+
+		r = &ring -> slots[head % LOG_RING_SLOTS];
+	}
+	else
+	{
+		r = &direct;
+	}
+
+	clock_gettime(CLOCK_REALTIME, &r -> ts);
+	r -> level = level;
+
+	va_list ap;
+	va_start(ap, fmt);
+	vsnprintf(r -> text, sizeof r -> text, fmt, ap);
+	va_end(ap);
+
+	if (ring)
+		ring -> head.store(head + 1, std::memory_order_release);
+	else
+		write_record(direct, "main");
+}
+
+void log_set_level(const log_level_t level)
+{
+	cur_level = level;
+}
+
+log_level_t log_get_level()
+{
+	return log_level_t(cur_level.load());
+}
+
+bool log_enabled(const log_level_t level)
+{
+	return level <= cur_level;
+}
+
+const char *log_level_name(const log_level_t level)
+{
+	return level_names[level];
+}
+
+bool log_level_by_name(const char *const name, log_level_t *const level)
+{
+	for(int i=0; i<N_LOG_LEVELS; i++)
+	{
+		if (strcmp(name, level_names[i]) == 0)
+		{
+			*level = log_level_t(i);
+
+			return true;
+		}
+	}
+
+	return false;
+}
+
+void log_get_stats(log_stats_t *const stats)
+{
+	stats -> level = log_get_level();
+	stats -> written = written;
+	stats -> threads = n_rings;
+
+	uint64_t dropped = lost;
+
+	const int n = n_rings.load(std::memory_order_acquire);
+	for(int i=0; i<n; i++)
+		dropped += rings[i] -> dropped;
+
+	stats -> dropped = dropped;
+}
@@ -0,0 +1,42 @@
+#ifndef __LOG_H__
+#define __LOG_H__
+
+#include <stdint.h>
+
+typedef enum { LL_ERROR = 0, LL_WARNING, LL_INFO, LL_DEBUG, N_LOG_LEVELS } log_level_t;
+
+// messages longer than this are cut off
+#define LOG_MSG_SIZE 240
+// messages each thread can have waiting before new ones are dropped
+#define LOG_RING_SLOTS 256
+// how often the log thread looks for messages
+#define LOG_DRAIN_INTERVAL_US 10000
+
+typedef struct {
+	log_level_t level;
+	uint64_t written, dropped;
+	int threads;
+} log_stats_t;
+
+// from the moment log_start() is called, messages are put in a ring of the
+// thread that logs them and written by a thread of their own: logging never
+// waits for stdout or stderr. before that they are written directly
+void log_start();
+// writes what is still waiting
+void log_stop();
+
+// no '\n' needed at the end
+void log_msg(const log_level_t level, const char *const fmt, ...) __attribute__((format(printf, 2, 3)));
+
+void log_set_level(const log_level_t level);
+log_level_t log_get_level();
+// to skip preparing a message that would not be logged anyway
+bool log_enabled(const log_level_t level);
+
+const char *log_level_name(const log_level_t level);
+// false when name is not a level
+bool log_level_by_name(const char *const name, log_level_t *const level);
+
+void log_get_stats(log_stats_t *const stats);
+
+#endif
@@ -0,0 +1,36 @@
+#ifndef __MEMORY_CANVAS_H__
+#define __MEMORY_CANVAS_H__
+
+#include <stdint.h>
+#include <string.h>
+
+#include "canvas.h"
+
+// a canvas that only keeps the pixels, rgb, row by row
+class memory_canvas : public rgb_matrix::Canvas {
+private:
+	const int w, h;
+	uint8_t *pixels;
+
+public:
+	memory_canvas(const int w_in, const int h_in) : w(w_in), h(h_in) { pixels = new uint8_t[w * h * 3](); }
+	virtual ~memory_canvas() { delete [] pixels; }
+
+	virtual int width() const { return w; }
+	virtual int height() const { return h; }
+	virtual void SetPixel(int x, int y, uint8_t red, uint8_t green, uint8_t blue) {
+		if (x < 0 || y < 0 || x >= w || y >= h)
+			return;
+
+		uint8_t *p = &pixels[(y * w + x) * 3];
+		p[0] = red;
+		p[1] = green;
+		p[2] = blue;
+	}
+	virtual void Clear() { memset(pixels, 0x00, w * h * 3); }
+	virtual void Fill(uint8_t red, uint8_t green, uint8_t blue) { for(int i=0; i<w * h; i++) SetPixel(i % w, i / w, red, green, blue); }
+
+	const uint8_t *get_pixels() const { return pixels; }
+};
+
+#endif
@@ -0,0 +1,105 @@
+#ifndef __MPMC_QUEUE_H__
+#define __MPMC_QUEUE_H__
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+
+// bounded queue for any number of producers and consumers, without locks:
+// every cell carries a sequence number that tells whether it is free for
+// the producer with that position or filled for the consumer with it
+// (D. Vyukov's design). the size is rounded up to a power of two
+template <typename T>
+class mpmc_queue {
+private:
+	typedef struct {
+		std::atomic<size_t> seq;
+		T data;
+	} cell_t;
+
+	cell_t *cells;
+	size_t mask;
+
+	// keep the producer and consumer positions in different cache lines
+	char pad0[64];
+	std::atomic<size_t> enqueue_pos;
+	char pad1[64];
+	std::atomic<size_t> dequeue_pos;
+	char pad2[64];
+
+public:
+	mpmc_queue(const size_t size_in) {
+		size_t size = 2;
+		while(size < size_in)
+			size <<= 1;
+
+		cells = new cell_t[size];
+		mask = size - 1;
+
+		for(size_t i=0; i<size; i++)
+			cells[i].seq.store(i, std::memory_order_relaxed);
+
+		enqueue_pos.store(0, std::memory_order_relaxed);
+		dequeue_pos.store(0, std::memory_order_relaxed);
+	}
+
+	~mpmc_queue() {
+		delete [] cells;
+	}
+
+	// returns false when the queue is full
+	bool push(const T & data) {
+		size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+		cell_t *cell = NULL;
+
+		for(;;) {
+			cell = &cells[pos & mask];
+
+			const size_t seq = cell -> seq.load(std::memory_order_acquire);
+			const intptr_t dif = intptr_t(seq) - intptr_t(pos);
+
+			if (dif == 0) {
+				if (enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+					break;
+			}
+			else if (dif < 0)
+				return false;
+			else
+				pos = enqueue_pos.load(std::memory_order_relaxed);
+		}
+
+		cell -> data = data;
+		cell -> seq.store(pos + 1, std::memory_order_release);
+
+		return true;
+	}
+
+	// returns false when the queue is empty
+	bool pop(T *const data) {
+		size_t pos = dequeue_pos.load(std::memory_order_relaxed);
+		cell_t *cell = NULL;
+
+		for(;;) {
+			cell = &cells[pos & mask];
+
+			const size_t seq = cell -> seq.load(std::memory_order_acquire);
+			const intptr_t dif = intptr_t(seq) - intptr_t(pos + 1);
+
+			if (dif == 0) {
+				if (dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+					break;
+			}
+			else if (dif < 0)
+				return false;
+			else
+				pos = dequeue_pos.load(std::memory_order_relaxed);
+		}
+
+		*data = cell -> data;
+		cell -> seq.store(pos + mask + 1, std::memory_order_release);
+
+		return true;
+	}
+};
+
+#endif
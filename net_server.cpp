@@ -0,0 +1,644 @@
+#include <algorithm>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "error.h"
+#include "log.h"
+#include "net_server.h"
+#include "stats.h"
+#include "utils.h"
+
+// how many datagrams to handle before looking at the tcp connections again
+#define MAX_DGRAMS_PER_WAKEUP 64
+// room for bursts while the appliers are busy
+#define UDP_RCVBUF (4 * 1024 * 1024)
+#define UDP_BUFFER_SIZE 65536
+#define UDP_CONTROL_SIZE CMSG_SPACE(sizeof(uint32_t))
+
+static void set_nonblocking(const int fd)
+{
+	int flags = fcntl(fd, F_GETFL, 0);
+
+	if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1)
+		error_exit(true, "fcntl failed");
+}
+
+net_server::net_server(const int port_in, const request_handler_t handler_in, const order_key_t order_key_in, const idle_handler_t idle_in, void *const ctx_in, const int n_appliers) : port(port_in), handler(handler_in), order_key(order_key_in), idle(idle_in), ctx(ctx_in), next_serial(1), kernel_drops(0)
+{
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd == -1)
+		error_exit(true, "epoll_create1 failed");
+
+	udp_fd = start_listening_udp(port);
+	set_nonblocking(udp_fd);
+
+	int rcvbuf = UDP_RCVBUF, on = 1;
+	if (setsockopt(udp_fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof rcvbuf) == -1)
+		log_msg(LL_WARNING, "cannot enlarge udp receive buffer: %s", strerror(errno));
+
+	// let the kernel tell how many datagrams it had to drop
+	if (setsockopt(udp_fd, SOL_SOCKET, SO_RXQ_OVFL, &on, sizeof on) == -1)
+		log_msg(LL_WARNING, "SO_RXQ_OVFL not available: %s", strerror(errno));
+
+	buffers = new char[UDP_BATCH * UDP_BUFFER_SIZE];
+	controls = new char[UDP_BATCH * UDP_CONTROL_SIZE];
+
+	stopping = false;
+
+	pthread_mutex_init(&replies_lock, NULL);
+
+	wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (wake_fd == -1)
+		error_exit(true, "eventfd failed");
+
+	for(int i=0; i<std::max(1, n_appliers); i++)
+	{
+		lane_t *const l = new lane_t;
+		l -> ns = this;
+		l -> queue = new mpmc_queue<command_t *>(UDP_QUEUE_SIZE);
+		sem_init(&l -> ready, 0, 0);
+
+		pthread_create(&l -> th, NULL, applier_main, l);
+		set_thread_name(l -> th, format("applier%d", i));
+
+		lanes.push_back(l);
+	}
+
+	log_msg(LL_INFO, "UDP listener started for port %d", port);
+
+	tcp_fd = start_listening_tcp(port);
+	set_nonblocking(tcp_fd);
+	log_msg(LL_INFO, "TCP listener started for port %d", port);
+
+	struct epoll_event ev;
+	memset(&ev, 0x00, sizeof ev);
+
+	ev.events = EPOLLIN;
+	ev.data.fd = udp_fd;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, udp_fd, &ev) == -1)
+		error_exit(true, "epoll_ctl failed");
+
+	ev.data.fd = tcp_fd;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, tcp_fd, &ev) == -1)
+		error_exit(true, "epoll_ctl failed");
+
+	ev.data.fd = wake_fd;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &ev) == -1)
+		error_exit(true, "epoll_ctl failed");
+}
+
+net_server::~net_server()
+{
+	stopping = true;
+
+	for(size_t i=0; i<lanes.size(); i++)
+		sem_post(&lanes.at(i) -> ready);
+
+	for(size_t i=0; i<lanes.size(); i++)
+	{
+		lane_t *const l = lanes.at(i);
+
+		void *dummy = NULL;
+		pthread_join(l -> th, &dummy);
+
+		command_t *cmd = NULL;
+		while(l -> queue -> pop(&cmd))
+			delete cmd;
+
+		sem_destroy(&l -> ready);
+		delete l -> queue;
+		delete l;
+	}
+
+	delete [] controls;
+	delete [] buffers;
+
+	while(!connections.empty())
+		close_connection(connections.begin() -> first);
+
+	pthread_mutex_destroy(&replies_lock);
+
+	close(wake_fd);
+	close(tcp_fd);
+	close(udp_fd);
+	close(epoll_fd);
+}
+
+void net_server::update_events(const int fd, connection_t & c)
+{
+	struct epoll_event ev;
+	memset(&ev, 0x00, sizeof ev);
+
+	ev.events = (c.eof ? 0 : EPOLLIN) | (c.out.empty() ? 0 : EPOLLOUT);
+	ev.data.fd = fd;
+
+	if (ev.events == c.events)
+		return;
+
+	// a closed socket that only waits for replies would keep reporting
+	// EPOLLHUP: leave it out until there is something to write
+	int op = EPOLL_CTL_MOD;
+
+	if (ev.events == 0)
+		op = EPOLL_CTL_DEL;
+	else if (c.events == 0)
+		op = EPOLL_CTL_ADD;
+
+	c.events = ev.events;
+
+	if (epoll_ctl(epoll_fd, op, fd, &ev) == -1)
+		log_msg(LL_ERROR, "epoll_ctl failed: %s", strerror(errno));
+}
+
+void net_server::close_connection(const int fd)
+{
+	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+	close(fd);
+
+	connections.erase(fd);
+}
+
+void net_server::accept_connections()
+{
+	for(;;)
+	{
+		int fd = accept4(tcp_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+		if (fd == -1)
+		{
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+				log_msg(LL_ERROR, "accept failed: %s", strerror(errno));
+
+			break;
+		}
+
+		connection_t c;
+		c.scanned = 0;
+		c.depth = 0;
+		c.in_string = c.escape = c.eof = false;
+		c.events = EPOLLIN;
+		c.serial = next_serial++;
+		c.in_flight = 0;
+
+		connections.insert(std::pair<int, connection_t>(fd, c));
+
+		struct epoll_event ev;
+		memset(&ev, 0x00, sizeof ev);
+		ev.events = EPOLLIN;
+		ev.data.fd = fd;
+
+		if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1)
+		{
+			log_msg(LL_ERROR, "epoll_ctl failed: %s", strerror(errno));
+			close_connection(fd);
+		}
+	}
+}
+
+void *net_server::applier_main(void *p)
+{
+	lane_t *const l = (lane_t *)p;
+
+	l -> ns -> applier(l);
+
+	return NULL;
+}
+
+void net_server::applier(lane_t *const l)
+{
+	for(;;)
+	{
+		if (sem_wait(&l -> ready) == -1)
+			continue;
+
+		command_t *cmd = NULL;
+
+		// every token stands for a queued command, but a producer may
+		// still be busy filling its cell
+		while(!l -> queue -> pop(&cmd))
+		{
+			if (stopping)
+				return;
+
+			sched_yield();
+		}
+
+		handle_command(cmd);
+
+		delete cmd;
+	}
+}
+
+void net_server::handle_command(const command_t *const cmd)
+{
+	std::string reply;
+	handler(cmd -> msg, cmd -> received_ns, &reply, ctx);
+
+	if (cmd -> serial == 0)
+	{
+		if (!reply.empty() && sendto(udp_fd, reply.c_str(), reply.size(), 0, (const struct sockaddr *)&cmd -> from, cmd -> from_len) == -1)
+			log_msg(LL_WARNING, "failed sending reply: %s", strerror(errno));
+
+		return;
+	}
+
+	// also without a reply: the event loop counts the commands in flight
+	tcp_reply_t r;
+	r.fd = cmd -> fd;
+	r.serial = cmd -> serial;
+
+	// replies use the framing of the command
+	if (cmd -> length_prefixed && !reply.empty())
+	{
+		const uint32_t rlen = htonl(reply.size());
+		r.data.assign((const char *)&rlen, 4);
+	}
+
+	r.data += reply;
+
+	pthread_mutex_lock(&replies_lock);
+	replies.push_back(r);
+	pthread_mutex_unlock(&replies_lock);
+
+	const uint64_t one = 1;
+	if (write(wake_fd, &one, sizeof one) == -1 && errno != EAGAIN)
+		log_msg(LL_ERROR, "cannot wake up event loop: %s", strerror(errno));
+}
+
+void net_server::queue_command(command_t *const cmd, lane_t *const l)
+{
+	if (!l -> queue -> push(cmd))
+	{
+		// the applier is behind: stop reading until it made room, what
+		// arrives meanwhile waits in the socket buffers
+		if (cmd -> serial == 0)
+			stats_count(CNT_UDP_QUEUE_FULL);
+
+		do
+		{
+			usleep(UDP_FULL_WAIT_US);
+		}
+		while(!l -> queue -> push(cmd));
+	}
+
+	sem_post(&l -> ready);
+}
+
+void net_server::queue_frame(const int fd, connection_t *const c, const std::string & msg, const int64_t received_ns, const bool length_prefixed)
+{
+	command_t *cmd = new command_t;
+	cmd -> msg = msg;
+	cmd -> received_ns = received_ns;
+	cmd -> from_len = 0;
+	cmd -> fd = fd;
+	cmd -> serial = c -> serial;
+	cmd -> length_prefixed = length_prefixed;
+
+	c -> in_flight++;
+
+	// one applier per connection keeps its commands in order
+	queue_command(cmd, lanes.at(c -> serial % lanes.size()));
+}
+
+void net_server::receive_datagrams()
+{
+	for(int done=0; done<MAX_DGRAMS_PER_WAKEUP;)
+	{
+		for(int i=0; i<UDP_BATCH; i++)
+		{
+			iovs[i].iov_base = &buffers[i * UDP_BUFFER_SIZE];
+			iovs[i].iov_len = UDP_BUFFER_SIZE;
+
+			struct msghdr & h = msgs[i].msg_hdr;
+			h.msg_name = &addrs[i];
+			h.msg_namelen = sizeof addrs[i];
+			h.msg_iov = &iovs[i];
+			h.msg_iovlen = 1;
+			h.msg_control = &controls[i * UDP_CONTROL_SIZE];
+			h.msg_controllen = UDP_CONTROL_SIZE;
+			h.msg_flags = 0;
+		}
+
+		int n = recvmmsg(udp_fd, msgs, UDP_BATCH, MSG_DONTWAIT, NULL);
+
+		if (n == -1)
+		{
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+				log_msg(LL_ERROR, "recvmmsg failed: %s", strerror(errno));
+
+			break;
+		}
+
+		stats_count(CNT_UDP_RECEIVED, n);
+
+		const int64_t now = get_mono_ns();
+
+		for(int i=0; i<n; i++)
+		{
+			struct msghdr & h = msgs[i].msg_hdr;
+
+			for(struct cmsghdr *cm = CMSG_FIRSTHDR(&h); cm; cm = CMSG_NXTHDR(&h, cm))
+			{
+				if (cm -> cmsg_level != SOL_SOCKET || cm -> cmsg_type != SO_RXQ_OVFL)
+					continue;
+
+				// a running total of the socket
+				uint32_t total = 0;
+				memcpy(&total, CMSG_DATA(cm), sizeof total);
+
+				stats_count(CNT_UDP_KERNEL_DROPS, total - kernel_drops);
+				kernel_drops = total;
+			}
+
+			if (h.msg_flags & MSG_TRUNC)
+			{
+				stats_count(CNT_UDP_TRUNCATED);
+				continue;
+			}
+
+			command_t *cmd = new command_t;
+			cmd -> msg.assign(&buffers[i * UDP_BUFFER_SIZE], msgs[i].msg_len);
+			cmd -> received_ns = now;
+			memcpy(&cmd -> from, &addrs[i], h.msg_namelen);
+			cmd -> from_len = h.msg_namelen;
+			cmd -> fd = -1;
+			cmd -> serial = 0;
+			cmd -> length_prefixed = false;
+
+			queue_command(cmd, lanes.at(order_key(cmd -> msg) % lanes.size()));
+		}
+
+		done += n;
+
+		if (n < UDP_BATCH)
+			break;
+	}
+}
+
+// returns false when the connection should be closed
+bool net_server::read_connection(const int fd, connection_t *const c)
+{
+	char buffer[16384];
+
+	int rc = read(fd, buffer, sizeof buffer);
+
+	if (rc == -1)
+		return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+
+	if (rc == 0)
+	{
+		// whatever is left is what used to be sent as one command per connection
+		if (c -> in.find_first_not_of(" \t\r\n") != std::string::npos)
+			queue_frame(fd, c, c -> in, get_mono_ns(), false);
+
+		c -> in.clear();
+		c -> eof = true;
+
+		return true;
+	}
+
+	c -> in.append(buffer, rc);
+
+	return true;
+}
+
+bool net_server::write_connection(const int fd, connection_t *const c)
+{
+	while(!c -> out.empty())
+	{
+		int rc = write(fd, c -> out.data(), c -> out.size());
+
+		if (rc == -1)
+			return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+
+		c -> out.erase(0, rc);
+	}
+
+	return true;
+}
+
+void net_server::process_frames(const int fd, connection_t *const c, const int64_t received_ns)
+{
+	std::string & in = c -> in;
+	size_t pos = 0;
+
+	while(pos < in.size())
+	{
+		const unsigned char first = in[pos];
+
+		if (first == 0x00)
+		{
+			// length prefixed
+			if (in.size() - pos < 4)
+				break;
+
+			const uint32_t len = (uint32_t(uint8_t(in[pos + 0])) << 24) | (uint8_t(in[pos + 1]) << 16) | (uint8_t(in[pos + 2]) << 8) | uint8_t(in[pos + 3]);
+
+			if (len > MAX_FRAME_SIZE)
+				throw std::string("frame too big");
+
+			if (in.size() - pos - 4 < len)
+				break;
+
+			queue_frame(fd, c, in.substr(pos + 4, len), received_ns, true);
+
+			pos += 4 + len;
+
+			continue;
+		}
+
+		if (first == ' ' || first == '\t' || first == '\r' || first == '\n')
+		{
+			pos++;
+			continue;
+		}
+
+		if (first != '{')
+			throw std::string("not a json object");
+
+		// json text: ends at the brace that closes the first one
+		size_t i = pos + c -> scanned;
+		bool complete = false;
+
+		for(; i<in.size(); i++)
+		{
+			const char ch = in[i];
+
+			if (c -> in_string)
+			{
+				if (c -> escape)
+					c -> escape = false;
+				else if (ch == '\\')
+					c -> escape = true;
+				else if (ch == '"')
+					c -> in_string = false;
+			}
+			else if (ch == '"')
+				c -> in_string = true;
+			else if (ch == '{' || ch == '[')
+				c -> depth++;
+			else if ((ch == '}' || ch == ']') && --c -> depth == 0)
+			{
+				complete = true;
+				break;
+			}
+		}
+
+		if (!complete)
+		{
+			c -> scanned = i - pos;
+
+			if (c -> scanned > MAX_FRAME_SIZE)
+				throw std::string("frame too big");
+
+			break;
+		}
+
+		queue_frame(fd, c, in.substr(pos, i + 1 - pos), received_ns, false);
+
+		c -> scanned = 0;
+		c -> depth = 0;
+		c -> in_string = c -> escape = false;
+
+		pos = i + 1;
+	}
+
+	in.erase(0, pos);
+}
+
+// replies the appliers finished since the last call
+void net_server::collect_replies()
+{
+	uint64_t dummy = 0;
+	if (read(wake_fd, &dummy, sizeof dummy) == -1 && errno != EAGAIN)
+		log_msg(LL_ERROR, "eventfd read failed: %s", strerror(errno));
+
+	std::vector<tcp_reply_t> todo;
+
+	pthread_mutex_lock(&replies_lock);
+	todo.swap(replies);
+	pthread_mutex_unlock(&replies_lock);
+
+	for(size_t i=0; i<todo.size(); i++)
+	{
+		const tcp_reply_t & r = todo.at(i);
+
+		std::map<int, connection_t>::iterator it = connections.find(r.fd);
+
+		// closed meanwhile
+		if (it == connections.end() || it -> second.serial != r.serial)
+			continue;
+
+		connection_t *const c = &it -> second;
+
+		c -> out += r.data;
+		c -> in_flight--;
+
+		service_connection(r.fd, c, true);
+	}
+}
+
+// writes what is pending, then closes the connection or updates what to wait for
+void net_server::service_connection(const int fd, connection_t *const c, bool ok)
+{
+	if (ok && c -> out.size() > MAX_OUTPUT_PENDING)
+	{
+		log_msg(LL_WARNING, "closing connection: client does not read its replies");
+		ok = false;
+	}
+
+	if (ok)
+		ok = write_connection(fd, c);
+
+	if (!ok || (c -> eof && c -> out.empty() && c -> in_flight == 0))
+		close_connection(fd);
+	else
+		update_events(fd, *c);
+}
+
+void net_server::run(const std::atomic_bool *const stop)
+{
+	const int max_events = 64;
+	struct epoll_event events[max_events];
+
+	int64_t last_idle = 0;
+
+	while(!*stop)
+	{
+		int n = epoll_wait(epoll_fd, events, max_events, 250);
+
+		if (n == -1)
+		{
+			if (errno == EINTR)
+				continue;
+
+			error_exit(true, "epoll_wait failed");
+		}
+
+		for(int i=0; i<n; i++)
+		{
+			const int fd = events[i].data.fd;
+
+			if (fd == udp_fd)
+			{
+				receive_datagrams();
+				continue;
+			}
+
+			if (fd == tcp_fd)
+			{
+				accept_connections();
+				continue;
+			}
+
+			if (fd == wake_fd)
+			{
+				collect_replies();
+				continue;
+			}
+
+			std::map<int, connection_t>::iterator it = connections.find(fd);
+			if (it == connections.end())
+				continue;
+
+			connection_t *const c = &it -> second;
+			bool ok = true;
+
+			if ((events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) && !c -> eof)
+			{
+				try
+				{
+					// a command counts as received once its last byte is read
+					const int64_t received_ns = get_mono_ns();
+
+					ok = read_connection(fd, c);
+
+					if (ok)
+						process_frames(fd, c, received_ns);
+				}
+				catch(const std::string & e)
+				{
+					log_msg(LL_WARNING, "closing connection: %s", e.c_str());
+					ok = false;
+				}
+			}
+
+			service_connection(fd, c, ok);
+		}
+
+		const int64_t now = get_mono_ns() / 1000;
+		if (idle && now - last_idle >= 250000)
+		{
+			idle(ctx);
+			last_idle = now;
+		}
+	}
+}
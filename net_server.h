@@ -0,0 +1,140 @@
+#ifndef __NET_SERVER_H__
+#define __NET_SERVER_H__
+
+#include <atomic>
+#include <map>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <sys/socket.h>
+
+#include "mpmc_queue.h"
+
+// handles one command; received_ns is when it was read from the socket
+// (get_mono_ns()), reply, when not NULL, receives what to send back
+typedef void (*request_handler_t)(const std::string & msg, const int64_t received_ns, std::string *const reply, void *const ctx);
+// commands with the same key are applied in the order they arrived
+typedef uint32_t (*order_key_t)(const std::string & msg);
+// called every now and then from the event loop
+typedef void (*idle_handler_t)(void *const ctx);
+
+// frames bigger than this close the connection
+#define MAX_FRAME_SIZE (1024 * 1024)
+// a client that does not read its replies gets disconnected at this point
+#define MAX_OUTPUT_PENDING (1024 * 1024)
+
+// datagrams received with one recvmmsg() call
+#define UDP_BATCH 16
+// per applier
+#define UDP_QUEUE_SIZE 4096
+// how long to stop reading when an applier's queue is full
+#define UDP_FULL_WAIT_US 100
+#define DEFAULT_UDP_APPLIERS 1
+
+// one thread serving udp and any number of tcp connections through epoll,
+// and a pool of applier threads that run the commands
+//
+// datagrams are read in batches and queued for the appliers, each with a
+// queue of its own: the order key of a command picks the queue, so
+// commands about the same element are applied in order while others run
+// in parallel. when a queue is full, reading stops until there is room
+// again and new datagrams wait in the socket buffer
+//
+// a tcp connection carries a sequence of commands, each either a json
+// object (the object's closing brace ends it, so newline-delimited json
+// works) or a 32 bit big-endian length followed by that many bytes. all
+// commands of a connection go to the same applier, which keeps them and
+// their replies in order; the replies are handed back to the event loop
+// for writing
+class net_server {
+private:
+	typedef struct {
+		std::string in, out;
+		// scanner state for a text frame that is not complete yet
+		size_t scanned;
+		int depth;
+		bool in_string, escape;
+		bool eof;
+		uint32_t events;
+		// replies are matched by fd and serial: the fd may be reused
+		uint64_t serial;
+		int in_flight;
+	} connection_t;
+
+	const int port;
+	const request_handler_t handler;
+	const order_key_t order_key;
+	const idle_handler_t idle;
+	void *const ctx;
+
+	typedef struct {
+		std::string msg;
+		int64_t received_ns;
+		// udp: where the reply goes
+		struct sockaddr_storage from;
+		socklen_t from_len;
+		// tcp: the connection, serial 0 for udp
+		int fd;
+		uint64_t serial;
+		bool length_prefixed;
+	} command_t;
+
+	typedef struct {
+		int fd;
+		uint64_t serial;
+		std::string data; // framed, may be empty
+	} tcp_reply_t;
+
+	int epoll_fd, udp_fd, tcp_fd;
+	std::map<int, connection_t> connections;
+	uint64_t next_serial;
+
+	// filled by the appliers, an eventfd wakes up the event loop
+	pthread_mutex_t replies_lock;
+	std::vector<tcp_reply_t> replies;
+	int wake_fd;
+
+	// recvmmsg() buffers
+	struct mmsghdr msgs[UDP_BATCH];
+	struct iovec iovs[UDP_BATCH];
+	struct sockaddr_storage addrs[UDP_BATCH];
+	char *buffers, *controls;
+	uint32_t kernel_drops;
+
+	typedef struct {
+		net_server *ns;
+		mpmc_queue<command_t *> *queue;
+		sem_t ready;
+		pthread_t th;
+	} lane_t;
+
+	std::vector<lane_t *> lanes;
+	std::atomic_bool stopping;
+
+	static void *applier_main(void *p);
+	void applier(lane_t *const l);
+	void handle_command(const command_t *const cmd);
+	void queue_command(command_t *const cmd, lane_t *const l);
+	void queue_frame(const int fd, connection_t *const c, const std::string & msg, const int64_t received_ns, const bool length_prefixed);
+
+	void accept_connections();
+	void receive_datagrams();
+	bool read_connection(const int fd, connection_t *const c);
+	bool write_connection(const int fd, connection_t *const c);
+	void process_frames(const int fd, connection_t *const c, const int64_t received_ns);
+	void collect_replies();
+	void service_connection(const int fd, connection_t *const c, bool ok);
+	void close_connection(const int fd);
+	void update_events(const int fd, connection_t & c);
+
+public:
+	net_server(const int port_in, const request_handler_t handler_in, const order_key_t order_key_in, const idle_handler_t idle_in, void *const ctx_in, const int n_appliers);
+	virtual ~net_server();
+
+	// returns when *stop becomes true
+	void run(const std::atomic_bool *const stop);
+};
+
+#endif
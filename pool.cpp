@@ -0,0 +1,161 @@
+#include "pool.h"
+
+buffer_pool pixel_buffers(DEFAULT_POOL_MAX_FREE_BYTES);
+
+buffer_pool::buffer_pool(const size_t max_free_bytes_in) : free_bytes(0), max_free_bytes(max_free_bytes_in), oversized(0)
+{
+	for(int i=0; i<POOL_N_CLASSES; i++)
+	{
+		classes[i].in_use = classes[i].high_water = 0;
+		classes[i].gets = classes[i].heap_allocs = 0;
+	}
+
+	pthread_mutex_init(&lock, NULL);
+}
+
+buffer_pool::~buffer_pool()
+{
+	for(int i=0; i<POOL_N_CLASSES; i++)
+	{
+		for(size_t j=0; j<classes[i].free_list.size(); j++)
+			delete [] classes[i].free_list.at(j);
+	}
+
+	pthread_mutex_destroy(&lock);
+}
+
+// -1 when it is too large for the pool
+int buffer_pool::get_class(const size_t bytes)
+{
+	int c = 0;
+
+	while((size_t(1) << (c + POOL_MIN_CLASS_SHIFT)) < bytes)
+	{
+		if (++c == POOL_N_CLASSES)
+			return -1;
+	}
+
+	return c;
+}
+
+uint8_t *buffer_pool::get(const size_t bytes)
+{
+	const int c = get_class(bytes);
+
+	if (c == -1)
+	{
+		pthread_mutex_lock(&lock);
+		oversized++;
+		pthread_mutex_unlock(&lock);
+
+		return new uint8_t[bytes];
+	}
+
+	size_class_t & sc = classes[c];
+	uint8_t *p = NULL;
+
+	pthread_mutex_lock(&lock);
+
+	sc.gets++;
+
+	if (++sc.in_use > sc.high_water)
+		sc.high_water = sc.in_use;
+
+	if (!sc.free_list.empty())
+	{
+		p = sc.free_list.back();
+		sc.free_list.pop_back();
+
+		free_bytes -= size_t(1) << (c + POOL_MIN_CLASS_SHIFT);
+	}
+	else
+	{
+		sc.heap_allocs++;
+	}
+
+	pthread_mutex_unlock(&lock);
+
+	if (!p)
+		p = new uint8_t[size_t(1) << (c + POOL_MIN_CLASS_SHIFT)];
+
+	return p;
+}
+
+void buffer_pool::put(uint8_t *const p, const size_t bytes)
+{
+	if (!p)
+		return;
+
+	const int c = get_class(bytes);
+
+	if (c == -1)
+	{
+		delete [] p;
+
+		return;
+	}
+
+	size_class_t & sc = classes[c];
+	const size_t class_bytes = size_t(1) << (c + POOL_MIN_CLASS_SHIFT);
+	bool keep = false;
+
+	pthread_mutex_lock(&lock);
+
+	sc.in_use--;
+
+	// the free list has room for each buffer that was ever handed out at
+	// the same time, so it only grows while the high-water mark does
+	if (free_bytes + class_bytes <= max_free_bytes)
+	{
+		if (sc.free_list.capacity() < sc.high_water)
+			sc.free_list.reserve(sc.high_water);
+
+		sc.free_list.push_back(p);
+		free_bytes += class_bytes;
+
+		keep = true;
+	}
+
+	pthread_mutex_unlock(&lock);
+
+	if (!keep)
+		delete [] p;
+}
+
+void buffer_pool::set_max_free_bytes(const size_t max_free_bytes_in)
+{
+	pthread_mutex_lock(&lock);
+	max_free_bytes = max_free_bytes_in;
+	pthread_mutex_unlock(&lock);
+}
+
+void buffer_pool::get_stats(std::vector<buffer_class_stats_t> *const stats, size_t *const free_bytes_out, uint64_t *const oversized_out)
+{
+	stats -> clear();
+
+	pthread_mutex_lock(&lock);
+
+	for(int i=0; i<POOL_N_CLASSES; i++)
+	{
+		const size_class_t & sc = classes[i];
+
+		if (sc.gets == 0)
+			continue;
+
+		buffer_class_stats_t bcs;
+		bcs.size = size_t(1) << (i + POOL_MIN_CLASS_SHIFT);
+		bcs.ps.in_use = sc.in_use;
+		bcs.ps.high_water = sc.high_water;
+		bcs.ps.capacity = sc.in_use + sc.free_list.size();
+		bcs.ps.gets = sc.gets;
+		bcs.ps.heap_allocs = sc.heap_allocs;
+		bcs.n_free = sc.free_list.size();
+
+		stats -> push_back(bcs);
+	}
+
+	*free_bytes_out = free_bytes;
+	*oversized_out = oversized;
+
+	pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,171 @@
+#ifndef __POOL_H__
+#define __POOL_H__
+
+#include <new>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// objects per slab of an object_pool
+#define POOL_SLAB_OBJECTS 32
+
+// pixel buffers come in power-of-two classes from 256 bytes to 4MB; larger
+// ones go to the heap directly
+#define POOL_MIN_CLASS_SHIFT 8
+#define POOL_MAX_CLASS_SHIFT 22
+#define POOL_N_CLASSES (POOL_MAX_CLASS_SHIFT - POOL_MIN_CLASS_SHIFT + 1)
+
+// free buffers above this are returned to the heap
+#define DEFAULT_POOL_MAX_FREE_BYTES (8 * 1024 * 1024)
+
+typedef struct {
+	size_t in_use, high_water, capacity;
+	// gets that needed memory from the heap
+	uint64_t gets, heap_allocs;
+} pool_stats_t;
+
+// fixed size objects, carved from slabs that are never returned: once the
+// pool has grown to the high-water mark, get() and put() do not touch the heap
+template <typename T>
+class object_pool {
+private:
+	typedef typename std::aligned_storage<sizeof(T), alignof(T)>::type slot_t;
+
+	std::vector<slot_t *> slabs;
+	std::vector<T *> free_slots;
+	size_t in_use, high_water;
+	uint64_t gets, heap_allocs;
+
+	pthread_mutex_t lock;
+
+public:
+	object_pool() : in_use(0), high_water(0), gets(0), heap_allocs(0) {
+		pthread_mutex_init(&lock, NULL);
+	}
+
+	virtual ~object_pool() {
+		for(size_t i=0; i<slabs.size(); i++)
+			delete [] slabs.at(i);
+
+		pthread_mutex_destroy(&lock);
+	}
+
+	// constructs a T with these arguments in a free slot; whatever the
+	// constructor throws is passed on
+	template <typename... A>
+	T *get(A&&... args) {
+		pthread_mutex_lock(&lock);
+
+		if (free_slots.empty())
+		{
+			slot_t *slab = new slot_t[POOL_SLAB_OBJECTS];
+			slabs.push_back(slab);
+
+			free_slots.reserve(slabs.size() * POOL_SLAB_OBJECTS);
+
+			for(int i=POOL_SLAB_OBJECTS - 1; i>=0; i--)
+				free_slots.push_back((T *)&slab[i]);
+
+			heap_allocs++;
+		}
+
+		T *p = free_slots.back();
+		free_slots.pop_back();
+
+		gets++;
+
+		if (++in_use > high_water)
+			high_water = in_use;
+
+		pthread_mutex_unlock(&lock);
+
+		try
+		{
+			return new (p) T(std::forward<A>(args)...);
+		}
+		catch(...)
+		{
+			release(p);
+
+			throw;
+		}
+	}
+
+	void put(T *const p) {
+		if (!p)
+			return;
+
+		p -> ~T();
+
+		release(p);
+	}
+
+	// the slot of an object that is already destructed
+	void release(T *const p) {
+		pthread_mutex_lock(&lock);
+
+		// never grows: there is room for every slot of every slab
+		free_slots.push_back(p);
+
+		in_use--;
+
+		pthread_mutex_unlock(&lock);
+	}
+
+	void get_stats(pool_stats_t *const stats) {
+		pthread_mutex_lock(&lock);
+
+		stats -> in_use = in_use;
+		stats -> high_water = high_water;
+		stats -> capacity = slabs.size() * POOL_SLAB_OBJECTS;
+		stats -> gets = gets;
+		stats -> heap_allocs = heap_allocs;
+
+		pthread_mutex_unlock(&lock);
+	}
+};
+
+typedef struct {
+	size_t size;
+	pool_stats_t ps;
+	size_t n_free;
+} buffer_class_stats_t;
+
+// pixel buffers, kept in lists of free ones per size class when given back
+class buffer_pool {
+private:
+	typedef struct {
+		std::vector<uint8_t *> free_list;
+		size_t in_use, high_water;
+		uint64_t gets, heap_allocs;
+	} size_class_t;
+
+	size_class_t classes[POOL_N_CLASSES];
+	size_t free_bytes, max_free_bytes;
+	uint64_t oversized;
+
+	pthread_mutex_t lock;
+
+	static int get_class(const size_t bytes);
+
+public:
+	buffer_pool(const size_t max_free_bytes_in);
+	virtual ~buffer_pool();
+
+	// at least bytes large, not cleared
+	uint8_t *get(const size_t bytes);
+	// bytes must be what it was asked for with
+	void put(uint8_t *const p, const size_t bytes);
+
+	void set_max_free_bytes(const size_t max_free_bytes_in);
+	// only the classes that were ever used
+	void get_stats(std::vector<buffer_class_stats_t> *const stats, size_t *const free_bytes_out, uint64_t *const oversized_out);
+};
+
+// the rendered texts of all elements
+extern buffer_pool pixel_buffers;
+
+#endif
@@ -0,0 +1,3 @@
+#! /bin/sh
+
+./send.py '{ "cmd":"rescan_fonts" }'
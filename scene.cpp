@@ -0,0 +1,112 @@
+#include <algorithm>
+
+#include "scene.h"
+
+scene::scene() : next_seq(0), n_prio_shown(0)
+{
+	pthread_mutex_init(&state_lock, NULL);
+}
+
+scene::~scene()
+{
+	pthread_mutex_destroy(&state_lock);
+}
+
+bool scene::draws_before(const disp_element_t *const a, const disp_element_t *const b)
+{
+	if (a -> z_depth != b -> z_depth)
+		return a -> z_depth < b -> z_depth;
+
+	return a -> seq < b -> seq;
+}
+
+void scene::insert(const std::string & id, disp_element_t *const de)
+{
+	de -> owner = this;
+	de -> seq = next_seq++;
+
+	by_id.insert(std::pair<std::string, disp_element_t *>(id, de));
+
+	// newest last: it is drawn over older elements with the same z_depth
+	by_depth.insert(std::upper_bound(by_depth.begin(), by_depth.end(), de, draws_before), de);
+
+	pthread_mutex_lock(&state_lock);
+
+	if (de -> prio && !de -> terminate && de -> pause == 0)
+		n_prio_shown++;
+
+	pthread_mutex_unlock(&state_lock);
+}
+
+void scene::erase(const iterator & it)
+{
+	disp_element_t *const de = it -> second;
+
+	std::vector<disp_element_t *>::iterator dit = std::lower_bound(by_depth.begin(), by_depth.end(), de, draws_before);
+	if (dit != by_depth.end() && *dit == de)
+		by_depth.erase(dit);
+
+	by_id.erase(it);
+
+	pthread_mutex_lock(&state_lock);
+
+	if (de -> prio && !de -> terminate && de -> pause == 0)
+		n_prio_shown--;
+
+	pthread_mutex_unlock(&state_lock);
+}
+
+void scene::rename(const iterator & it, const std::string & new_id)
+{
+	disp_element_t *const de = it -> second;
+
+	by_id.erase(it);
+	by_id.insert(std::pair<std::string, disp_element_t *>(new_id, de));
+}
+
+bool scene::terminate(disp_element_t *const de)
+{
+	pthread_mutex_lock(&state_lock);
+
+	const bool was = de -> terminate;
+
+	if (!was)
+	{
+		de -> terminate = true;
+
+		if (de -> prio && de -> pause == 0)
+			n_prio_shown--;
+	}
+
+	pthread_mutex_unlock(&state_lock);
+
+	return !was;
+}
+
+void scene::pause(disp_element_t *const de, const bool p)
+{
+	pthread_mutex_lock(&state_lock);
+
+	const bool shown_before = !de -> terminate && de -> pause == 0;
+
+	if (p)
+		de -> pause++;
+	else if (de -> pause > 0)
+		de -> pause--;
+
+	const bool shown_after = !de -> terminate && de -> pause == 0;
+
+	if (de -> prio && shown_before != shown_after)
+		n_prio_shown += shown_after ? 1 : -1;
+
+	pthread_mutex_unlock(&state_lock);
+}
+
+bool scene::has_prio()
+{
+	pthread_mutex_lock(&state_lock);
+	const bool rc = n_prio_shown > 0;
+	pthread_mutex_unlock(&state_lock);
+
+	return rc;
+}
@@ -0,0 +1,56 @@
+#ifndef __SCENE_H__
+#define __SCENE_H__
+
+#include <map>
+#include <pthread.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "disp_element.h"
+
+// all display elements: by id for the commands, and in drawing order
+// (z_depth, then the order in which they were added) for the compositor
+//
+// insert(), erase() and rename() need clients_lock for writing, the rest
+// can be used with a read lock; terminate() and pause() from anywhere
+class scene {
+private:
+	std::map<std::string, disp_element_t *> by_id;
+	std::vector<disp_element_t *> by_depth;
+	uint64_t next_seq;
+
+	// protects the terminate/pause transitions and the count below
+	pthread_mutex_t state_lock;
+	// prio elements that are not terminating and not paused
+	int n_prio_shown;
+
+	static bool draws_before(const disp_element_t *const a, const disp_element_t *const b);
+
+public:
+	typedef std::map<std::string, disp_element_t *>::iterator iterator;
+
+	scene();
+	virtual ~scene();
+
+	iterator begin() { return by_id.begin(); }
+	iterator end() { return by_id.end(); }
+	iterator find(const std::string & id) { return by_id.find(id); }
+	size_t size() const { return by_id.size(); }
+
+	void insert(const std::string & id, disp_element_t *const de);
+	void erase(const iterator & it);
+	// only changes the id, not the drawing order
+	void rename(const iterator & it, const std::string & new_id);
+
+	// returns false when the element was already terminating
+	bool terminate(disp_element_t *const de);
+	void pause(disp_element_t *const de, const bool p);
+
+	// when true, only prio elements are drawn
+	bool has_prio();
+
+	const std::vector<disp_element_t *> & get_by_depth() const { return by_depth; }
+};
+
+#endif
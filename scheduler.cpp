@@ -0,0 +1,153 @@
+#include <errno.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "log.h"
+#include "scheduler.h"
+#include "stats.h"
+#include "utils.h"
+
+scheduler::scheduler(const tick_function_t tick_in) : running(false), stop_flag(false), tick(tick_in)
+{
+	pthread_mutex_init(&lock, NULL);
+
+	// deadlines are on the monotonic clock: setting the time (ntp on a
+	// system without rtc) must not freeze or skip what is shown
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&cond, &attr);
+	pthread_condattr_destroy(&attr);
+}
+
+scheduler::~scheduler()
+{
+	stop();
+
+	pthread_cond_destroy(&cond);
+	pthread_mutex_destroy(&lock);
+}
+
+void *scheduler::thread_main(void *p)
+{
+	((scheduler *)p) -> run();
+
+	return NULL;
+}
+
+void scheduler::start()
+{
+	running = true;
+	stop_flag = false;
+
+	pthread_create(&th, NULL, thread_main, this);
+	set_thread_name(th, "scheduler");
+}
+
+void scheduler::stop()
+{
+	if (!running)
+		return;
+
+	pthread_mutex_lock(&lock);
+	stop_flag = true;
+	pthread_cond_signal(&cond);
+	pthread_mutex_unlock(&lock);
+
+	void *dummy = NULL;
+	pthread_join(th, &dummy);
+
+	running = false;
+
+	// whatever is still queued will never be advanced again
+	while(!queue.empty())
+	{
+		queue.top().de -> finished = true;
+		queue.pop();
+	}
+}
+
+void scheduler::add(disp_element_t *const de, const int64_t first_ts)
+{
+	pthread_mutex_lock(&lock);
+
+	// only wake up the thread when this one is due before what it is waiting for
+	bool wake = queue.empty() || first_ts < queue.top().ts;
+
+	sched_entry_t e = { first_ts, de };
+	queue.push(e);
+
+	if (wake)
+		pthread_cond_signal(&cond);
+
+	pthread_mutex_unlock(&lock);
+}
+
+void scheduler::run()
+{
+	log_msg(LL_INFO, "scheduler thread started");
+
+	std::vector<sched_entry_t> due;
+
+	pthread_mutex_lock(&lock);
+
+	while(!stop_flag)
+	{
+		if (queue.empty())
+		{
+			pthread_cond_wait(&cond, &lock);
+			continue;
+		}
+
+		int64_t now = get_mono_ns() / 1000;
+		int64_t next_ts = queue.top().ts;
+
+		if (next_ts > now)
+		{
+			struct timespec ts;
+			ts.tv_sec = next_ts / MILLION;
+			ts.tv_nsec = (next_ts % MILLION) * 1000;
+
+			pthread_cond_timedwait(&cond, &lock, &ts);
+			continue;
+		}
+
+		while(!queue.empty() && queue.top().ts <= now)
+		{
+			due.push_back(queue.top());
+			queue.pop();
+		}
+
+		// the ticks are done without the lock so that add() never waits for them
+		pthread_mutex_unlock(&lock);
+
+		size_t keep = 0;
+		for(size_t i=0; i<due.size(); i++)
+		{
+			int64_t next = tick(due.at(i).de, now);
+
+			if (next == -1)
+			{
+				// from here on the element may be freed by purge_elements()
+				due.at(i).de -> finished = true;
+				continue;
+			}
+
+			due.at(i).ts = next;
+			due.at(keep++) = due.at(i);
+		}
+
+		due.resize(keep);
+
+		pthread_mutex_lock(&lock);
+
+		for(size_t i=0; i<due.size(); i++)
+			queue.push(due.at(i));
+
+		due.clear();
+	}
+
+	pthread_mutex_unlock(&lock);
+
+	log_msg(LL_INFO, "scheduler thread terminating");
+}
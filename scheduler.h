@@ -0,0 +1,49 @@
+#ifndef __SCHEDULER_H__
+#define __SCHEDULER_H__
+
+#include <pthread.h>
+#include <queue>
+#include <stdint.h>
+#include <vector>
+
+#include "disp_element.h"
+
+// callback for an element that is due; returns the timestamp at which it
+// wants to be called again or -1 when it has finished. timestamps are
+// CLOCK_MONOTONIC in microseconds (get_mono_ns() / 1000)
+typedef int64_t (*tick_function_t)(disp_element_t *const de, const int64_t now);
+
+// one thread that advances all display elements, ordered by their deadline
+class scheduler {
+private:
+	typedef struct {
+		int64_t ts;
+		disp_element_t *de;
+	} sched_entry_t;
+
+	struct entry_later {
+		bool operator()(const sched_entry_t & a, const sched_entry_t & b) const { return a.ts > b.ts; }
+	};
+
+	std::priority_queue<sched_entry_t, std::vector<sched_entry_t>, entry_later> queue;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t th;
+	bool running, stop_flag;
+
+	const tick_function_t tick;
+
+	static void *thread_main(void *p);
+	void run();
+
+public:
+	scheduler(const tick_function_t tick_in);
+	virtual ~scheduler();
+
+	void start();
+	void stop();
+
+	void add(disp_element_t *const de, const int64_t first_ts);
+};
+
+#endif
@@ -0,0 +1,209 @@
+#include <algorithm>
+#include <atomic>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+#include <vector>
+
+#include "error.h"
+#include "stats.h"
+
+typedef struct {
+	// only written by the thread that owns them
+	std::atomic<uint64_t> n[N_STAGES], sum_ns[N_STAGES], max_ns[N_STAGES];
+	std::atomic<int64_t> ewma_ns[N_STAGES];
+	std::atomic<uint64_t> hist[N_STAGES][STATS_HIST_BUCKETS];
+	std::atomic<uint64_t> counters[N_COUNTERS];
+} thread_stats_t;
+
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static std::vector<thread_stats_t *> all_threads;
+// what threads that have ended left behind
+static thread_stats_t retired;
+
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t key;
+static __thread thread_stats_t *local = NULL;
+
+static const char *const stage_names[N_STAGES] = { "font_render", "image_decode", "compose", "bitblit", "push" };
+
+static inline void add(std::atomic<uint64_t> & a, const uint64_t v)
+{
+	a.store(a.load(std::memory_order_relaxed) + v, std::memory_order_relaxed);
+}
+
+static void thread_gone(void *p)
+{
+	thread_stats_t *const ts = (thread_stats_t *)p;
+
+	pthread_mutex_lock(&stats_lock);
+
+	for(int s=0; s<N_STAGES; s++) {
+		add(retired.n[s], ts -> n[s]);
+		add(retired.sum_ns[s], ts -> sum_ns[s]);
+
+		if (ts -> max_ns[s] > retired.max_ns[s])
+			retired.max_ns[s].store(ts -> max_ns[s]);
+
+		for(int b=0; b<STATS_HIST_BUCKETS; b++)
+			add(retired.hist[s][b], ts -> hist[s][b]);
+	}
+
+	for(int c=0; c<N_COUNTERS; c++)
+		add(retired.counters[c], ts -> counters[c]);
+
+	for(size_t i=0; i<all_threads.size(); i++) {
+		if (all_threads.at(i) == ts) {
+			all_threads.erase(all_threads.begin() + i);
+			break;
+		}
+	}
+
+	pthread_mutex_unlock(&stats_lock);
+
+	delete ts;
+}
+
+static void make_key()
+{
+	pthread_key_create(&key, thread_gone);
+}
+
+static thread_stats_t *get_local()
+{
+	if (!local) {
+		pthread_once(&key_once, make_key);
+
+		local = new thread_stats_t();
+		pthread_setspecific(key, local);
+
+		pthread_mutex_lock(&stats_lock);
+		all_threads.push_back(local);
+		pthread_mutex_unlock(&stats_lock);
+	}
+
+	return local;
+}
+
+int64_t get_mono_ns()
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+		error_exit(true, "clock_gettime failed");
+
+	return ts.tv_sec * 1000000000ll + ts.tv_nsec;
+}
+
+static int ns_to_bucket(const uint64_t ns)
+{
+	if (ns < 4)
+		return ns;
+
+	const int msb = 63 - __builtin_clzll(ns);
+	const int b = (msb - 1) * 4 + ((ns >> (msb - 2)) & 3);
+
+	return b < STATS_HIST_BUCKETS ? b : STATS_HIST_BUCKETS - 1;
+}
+
+// the middle of the range a bucket covers
+static double bucket_to_us(const int b)
+{
+	if (b < 4)
+		return b / 1000.0;
+
+	const int msb = b / 4 + 1;
+	const uint64_t low = uint64_t(4 + b % 4) << (msb - 2);
+
+	return (low + (uint64_t(1) << (msb - 2)) / 2.0) / 1000.0;
+}
+
+void stats_add_time(const stage_t stage, const int64_t ns)
+{
+	thread_stats_t *const ts = get_local();
+
+	add(ts -> n[stage], 1);
+	add(ts -> sum_ns[stage], ns);
+	add(ts -> hist[stage][ns_to_bucket(ns)], 1);
+
+	if (uint64_t(ns) > ts -> max_ns[stage].load(std::memory_order_relaxed))
+		ts -> max_ns[stage].store(ns, std::memory_order_relaxed);
+
+	const int64_t ewma = ts -> ewma_ns[stage].load(std::memory_order_relaxed);
+	ts -> ewma_ns[stage].store(ts -> n[stage] == 1 ? ns : ewma + (ns - ewma) / 16, std::memory_order_relaxed);
+}
+
+void stats_count(const counter_t counter, const uint64_t n)
+{
+	add(get_local() -> counters[counter], n);
+}
+
+void stats_get(stats_snapshot_t *const out)
+{
+	memset(out, 0x00, sizeof *out);
+
+	pthread_mutex_lock(&stats_lock);
+
+	for(int s=0; s<N_STAGES; s++) {
+		uint64_t hist[STATS_HIST_BUCKETS];
+		uint64_t n = retired.n[s], sum_ns = retired.sum_ns[s], max_ns = retired.max_ns[s];
+		uint64_t live_n = 0;
+		double ewma_sum = 0;
+
+		for(int b=0; b<STATS_HIST_BUCKETS; b++)
+			hist[b] = retired.hist[s][b];
+
+		for(size_t i=0; i<all_threads.size(); i++) {
+			const thread_stats_t *const ts = all_threads.at(i);
+			const uint64_t cur_n = ts -> n[s];
+
+			n += cur_n;
+			sum_ns += ts -> sum_ns[s];
+			max_ns = std::max(max_ns, uint64_t(ts -> max_ns[s]));
+
+			for(int b=0; b<STATS_HIST_BUCKETS; b++)
+				hist[b] += ts -> hist[s][b];
+
+			// threads that did more of the work weigh more
+			live_n += cur_n;
+			ewma_sum += double(ts -> ewma_ns[s]) * cur_n;
+		}
+
+		stage_stats_t & st = out -> stages[s];
+		st.n = n;
+
+		if (n == 0)
+			continue;
+
+		st.avg_us = sum_ns / 1000.0 / n;
+		st.recent_us = live_n ? ewma_sum / live_n / 1000.0 : st.avg_us;
+		st.max_us = max_ns / 1000.0;
+
+		const uint64_t n50 = (n * 50 + 99) / 100, n99 = (n * 99 + 99) / 100;
+		uint64_t seen = 0;
+
+		for(int b=0; b<STATS_HIST_BUCKETS && seen < n99; b++) {
+			if (seen < n50 && seen + hist[b] >= n50)
+				st.p50_us = std::min(bucket_to_us(b), st.max_us);
+
+			seen += hist[b];
+
+			if (seen >= n99)
+				st.p99_us = std::min(bucket_to_us(b), st.max_us);
+		}
+	}
+
+	for(int c=0; c<N_COUNTERS; c++) {
+		out -> counters[c] = retired.counters[c];
+
+		for(size_t i=0; i<all_threads.size(); i++)
+			out -> counters[c] += all_threads.at(i) -> counters[c];
+	}
+
+	pthread_mutex_unlock(&stats_lock);
+}
+
+const char *stats_stage_name(const stage_t stage)
+{
+	return stage_names[stage];
+}
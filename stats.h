@@ -0,0 +1,47 @@
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include <stdint.h>
+
+typedef enum { STAGE_FONT_RENDER = 0, STAGE_IMAGE_DECODE, STAGE_COMPOSE, STAGE_BITBLIT, STAGE_PUSH, N_STAGES } stage_t;
+
+typedef enum { CNT_COMMANDS = 0, CNT_BINARY_COMMANDS, CNT_PARSE_FAILURES, CNT_FACE_HITS, CNT_FACE_MISSES, CNT_FONT_NAME_HITS, CNT_FONT_NAME_MISSES, CNT_UDP_RECEIVED, CNT_UDP_QUEUE_FULL, CNT_UDP_TRUNCATED, CNT_UDP_KERNEL_DROPS, CNT_STREAM_FRAGMENTS, CNT_STREAM_REJECTED, N_COUNTERS } counter_t;
+
+// 4 buckets per power of two of nanoseconds
+#define STATS_HIST_BUCKETS 160
+
+typedef struct {
+	uint64_t n;
+	// over the whole run and exponentially weighted over the last samples
+	double avg_us, recent_us;
+	double p50_us, p99_us, max_us;
+} stage_stats_t;
+
+typedef struct {
+	stage_stats_t stages[N_STAGES];
+	uint64_t counters[N_COUNTERS];
+} stats_snapshot_t;
+
+// every thread counts in its own set of counters; they're only summed
+// up when someone asks for them
+void stats_add_time(const stage_t stage, const int64_t ns);
+void stats_count(const counter_t counter, const uint64_t n = 1);
+
+void stats_get(stats_snapshot_t *const out);
+
+const char *stats_stage_name(const stage_t stage);
+
+int64_t get_mono_ns();
+
+// times the scope it lives in
+class stage_timer {
+private:
+	const stage_t stage;
+	const int64_t start;
+
+public:
+	stage_timer(const stage_t stage_in) : stage(stage_in), start(get_mono_ns()) { }
+	~stage_timer() { stats_add_time(stage, get_mono_ns() - start); }
+};
+
+#endif
@@ -0,0 +1,269 @@
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "stats.h"
+#include "stream.h"
+#include "utils.h"
+
+stream_source::stream_source(const int w_in, const int h_in, const int late_ms) : shown_nr(0), w(w_in), h(h_in), late_ns(late_ms * 1000000ll)
+{
+	n_frames = n_dropped = n_late = n_torn = 0;
+}
+
+stream_source::~stream_source()
+{
+}
+
+void stream_source::account(const uint32_t nr, const int64_t ts_ns)
+{
+	// frames that were overwritten or lost before they could be shown
+	if (shown_nr != 0 && nr - shown_nr > 1 && int32_t(nr - shown_nr) > 0)
+		n_dropped += nr - shown_nr - 1;
+
+	shown_nr = nr;
+
+	n_frames++;
+
+	if (get_mono_ns() - ts_ns > late_ns)
+		n_late++;
+}
+
+void stream_source::get_stats(stream_stats_t *const s) const
+{
+	s -> frames = n_frames;
+	s -> dropped = n_dropped;
+	s -> late = n_late;
+	s -> torn = n_torn;
+}
+
+shm_stream_source::shm_stream_source(const std::string & name, const int w, const int h, const int late_ms) : stream_source(w, h, late_ms), ring(NULL), size(0), n_slots(0), slot(NULL), slot_seq(0)
+{
+	int fd = shm_open(name.c_str(), O_RDONLY, 0);
+	if (fd == -1)
+		throw format("cannot open shared memory object %s: %s", name.c_str(), strerror(errno));
+
+	struct stat st;
+	if (fstat(fd, &st) == -1 || size_t(st.st_size) < sizeof(stream_ring_header_t))
+	{
+		close(fd);
+
+		throw format("shared memory object %s is too small", name.c_str());
+	}
+
+	size = st.st_size;
+
+	void *p = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+
+	close(fd);
+
+	if (p == MAP_FAILED)
+		throw format("cannot map shared memory object %s: %s", name.c_str(), strerror(errno));
+
+	ring = (stream_ring_header_t *)p;
+
+	std::string error;
+
+	// read once: only these copies are used from here on
+	const uint32_t magic = ring -> magic, ring_w = ring -> w, ring_h = ring -> h;
+	n_slots = ring -> n_slots;
+
+	if (magic != STREAM_RING_MAGIC)
+		error = "is not a stream ring";
+	else if (ring_w != uint32_t(w) || ring_h != uint32_t(h))
+		error = format("has frames of %ux%u, the element is %dx%d", ring_w, ring_h, w, h);
+	else if (n_slots < 2)
+		error = "needs at least 2 slots";
+	// in slots, so that a huge n_slots cannot overflow the size
+	else if (size < stream_ring_size(w, h, 0) || n_slots > (size - stream_ring_size(w, h, 0)) / stream_ring_slot_size(w, h))
+		error = "is smaller than its slots";
+
+	if (!error.empty())
+	{
+		munmap(ring, size);
+
+		throw format("shared memory object %s %s", name.c_str(), error.c_str());
+	}
+}
+
+shm_stream_source::~shm_stream_source()
+{
+	munmap(ring, size);
+}
+
+void shm_stream_source::acquire()
+{
+	const uint32_t nr = ring -> frame_nr;
+	__sync_synchronize();
+
+	if (nr == 0 || (slot && slot -> frame_nr == nr && slot -> seq == slot_seq))
+		return;
+
+	const stream_slot_header_t *const s = stream_ring_slot(ring, n_slots, w, h, nr);
+
+	const uint32_t seq = s -> seq;
+	__sync_synchronize();
+
+	// the producer is already writing the next round into it: keep the
+	// current one, the next poll will have a newer frame
+	if ((seq & 1) || s -> frame_nr != nr)
+		return;
+
+	slot = s;
+	slot_seq = seq;
+
+	account(nr, s -> ts_ns);
+}
+
+bool shm_stream_source::still_valid()
+{
+	if (!slot)
+		return true;
+
+	__sync_synchronize();
+
+	if (slot -> seq == slot_seq)
+		return true;
+
+	n_torn++;
+
+	// draw the newest one instead
+	slot = NULL;
+
+	return false;
+}
+
+push_stream_source::push_stream_source(const int w, const int h, const int late_ms) : stream_source(w, h, late_ms), filling_nr(0)
+{
+	newest = 0;
+
+	arrived.reserve(64);
+
+	pthread_mutex_init(&producer_lock, NULL);
+
+	for(int i=0; i<3; i++)
+	{
+		stream_frame_t & f = frames.get_slot(i);
+
+		f.pixels = new uint8_t[w * h * 3];
+		f.frame_nr = 0;
+		f.ts_ns = 0;
+	}
+}
+
+push_stream_source::~push_stream_source()
+{
+	for(int i=0; i<3; i++)
+		delete [] frames.get_slot(i).pixels;
+
+	pthread_mutex_destroy(&producer_lock);
+}
+
+void push_stream_source::add_arrived(const uint32_t begin, const uint32_t end)
+{
+	// the first range that ends at or after begin: it and the ones after
+	// it that start at or before end merge with [begin, end)
+	size_t i = 0;
+	while(i < arrived.size() && arrived.at(i).second < begin)
+		i++;
+
+	size_t j = i;
+	uint32_t b = begin, e = end;
+
+	while(j < arrived.size() && arrived.at(j).first <= end)
+	{
+		b = std::min(b, arrived.at(j).first);
+		e = std::max(e, arrived.at(j).second);
+		j++;
+	}
+
+	if (i == j)
+	{
+		arrived.insert(arrived.begin() + i, std::pair<uint32_t, uint32_t>(b, e));
+	}
+	else
+	{
+		arrived.at(i) = std::pair<uint32_t, uint32_t>(b, e);
+		arrived.erase(arrived.begin() + i + 1, arrived.begin() + j);
+	}
+}
+
+bool push_stream_source::put_fragment(const uint32_t nr, const uint32_t offset, const uint32_t total, const uint8_t *const data, const size_t len, bool *const complete)
+{
+	*complete = false;
+
+	if (nr == 0 || total != uint32_t(w * h * 3) || offset > total || len > total - offset)
+		return false;
+
+	pthread_mutex_lock(&producer_lock);
+
+	// pieces of a frame older than the newest one are of no use anymore
+	if (int32_t(nr - newest) <= 0)
+	{
+		pthread_mutex_unlock(&producer_lock);
+
+		return true;
+	}
+
+	// a late piece of a frame before the one being filled
+	if (filling_nr != 0 && int32_t(nr - filling_nr) < 0)
+	{
+		pthread_mutex_unlock(&producer_lock);
+
+		return true;
+	}
+
+	stream_frame_t & back = frames.get_back();
+
+	// a newer frame started: whatever is missing of the one in the back slot won't come
+	if (nr != filling_nr)
+	{
+		filling_nr = nr;
+		arrived.clear();
+	}
+
+	if (len > 0)
+	{
+		memcpy(back.pixels + offset, data, len);
+		add_arrived(offset, offset + len);
+	}
+
+	if (arrived.size() == 1 && arrived.at(0).first == 0 && arrived.at(0).second == total)
+	{
+		back.frame_nr = nr;
+		back.ts_ns = get_mono_ns();
+
+		frames.publish();
+
+		newest = nr;
+		filling_nr = 0;
+		arrived.clear();
+
+		*complete = true;
+	}
+
+	pthread_mutex_unlock(&producer_lock);
+
+	return true;
+}
+
+void push_stream_source::acquire()
+{
+	if (!frames.acquire())
+		return;
+
+	const stream_frame_t & f = frames.get_front();
+
+	account(f.frame_nr, f.ts_ns);
+}
+
+const uint8_t *push_stream_source::get_pixels() const
+{
+	const stream_frame_t & f = frames.get_front();
+
+	return f.frame_nr ? f.pixels : NULL;
+}
@@ -0,0 +1,113 @@
+#ifndef __STREAM_H__
+#define __STREAM_H__
+
+#include <atomic>
+#include <pthread.h>
+#include <stdint.h>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "stream_ring.h"
+#include "triple_buffer.h"
+
+// frames older than this when the compositor picks them up are late
+#define DEFAULT_STREAM_LATE_MS 20
+// how often the scheduler looks for a new frame in a stream
+#define STREAM_POLL_US 2000
+
+typedef struct {
+	uint64_t frames, dropped, late, torn;
+} stream_stats_t;
+
+// raw rgb frames of the size of a stream element; the compositor draws
+// them straight from where they were received
+class stream_source {
+private:
+	// compositor side
+	uint32_t shown_nr;
+	std::atomic<uint64_t> n_frames, n_dropped, n_late;
+
+protected:
+	const int w, h;
+	const int64_t late_ns;
+	std::atomic<uint64_t> n_torn;
+
+	// the compositor switched to frame nr
+	void account(const uint32_t nr, const int64_t ts_ns);
+
+public:
+	stream_source(const int w_in, const int h_in, const int late_ms);
+	virtual ~stream_source();
+
+	// number of the newest complete frame, 0 when there is none yet
+	virtual uint32_t latest() const = 0;
+
+	// compositor: switch to the newest frame
+	virtual void acquire() = 0;
+	// compositor: pixels of the current frame (w * h * 3), NULL when there is none
+	virtual const uint8_t *get_pixels() const = 0;
+	// compositor, after drawing: false when the frame was overwritten meanwhile
+	virtual bool still_valid() { return true; }
+
+	void get_stats(stream_stats_t *const s) const;
+};
+
+// a ring of frames in a posix shared memory object made by the producer
+class shm_stream_source : public stream_source {
+private:
+	stream_ring_header_t *ring;
+	size_t size;
+	// from the header when it was checked; the producer can still change it there
+	uint32_t n_slots;
+	// the slot the compositor reads from, and its seq at that point
+	const stream_slot_header_t *slot;
+	uint32_t slot_seq;
+
+public:
+	// throws when the object is not there or does not fit the element
+	shm_stream_source(const std::string & name, const int w, const int h, const int late_ms);
+	virtual ~shm_stream_source();
+
+	uint32_t latest() const { return ring -> frame_nr; }
+
+	void acquire();
+	const uint8_t *get_pixels() const { return slot ? stream_slot_pixels(slot) : NULL; }
+	bool still_valid();
+};
+
+typedef struct {
+	uint8_t *pixels;
+	uint32_t frame_nr;
+	int64_t ts_ns;
+} stream_frame_t;
+
+// frames that arrive in pieces through the command socket
+class push_stream_source : public stream_source {
+private:
+	// the udp appliers can run in parallel
+	pthread_mutex_t producer_lock;
+	triple_buffer<stream_frame_t> frames;
+	// frame in the back slot and the byte ranges [first, second) of it
+	// that arrived, sorted and merged: a duplicate does not count twice
+	uint32_t filling_nr;
+	std::vector<std::pair<uint32_t, uint32_t> > arrived;
+	std::atomic<uint32_t> newest;
+
+	void add_arrived(const uint32_t begin, const uint32_t end);
+
+public:
+	push_stream_source(const int w, const int h, const int late_ms);
+	virtual ~push_stream_source();
+
+	uint32_t latest() const { return newest; }
+
+	// returns false when the piece does not fit the frame; sets *complete
+	// when it was the last missing piece of a frame
+	bool put_fragment(const uint32_t nr, const uint32_t offset, const uint32_t total, const uint8_t *const data, const size_t len, bool *const complete);
+
+	void acquire();
+	const uint8_t *get_pixels() const;
+};
+
+#endif
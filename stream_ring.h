@@ -0,0 +1,103 @@
+#ifndef __STREAM_RING_H__
+#define __STREAM_RING_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+// what producers of add_stream elements send: raw rgb frames of exactly
+// the size of the element, either in a shared memory ring or in pieces
+// through the command socket; only this header is needed for that
+
+#define STREAM_RING_MAGIC 0x4d535252 // "MSRR"
+#define STREAM_RING_ALIGN 64
+
+// the shared memory object is created by the producer and starts with
+// this header, n_slots slots follow it
+typedef struct {
+	uint32_t magic, w, h, n_slots;
+	// the newest complete frame, it is in slot frame_nr % n_slots; 0 for none yet
+	volatile uint32_t frame_nr;
+} stream_ring_header_t;
+
+// each slot starts with this header, the pixels follow at STREAM_RING_ALIGN
+typedef struct {
+	// odd while the slot is being written
+	volatile uint32_t seq;
+	uint32_t frame_nr;
+	// CLOCK_MONOTONIC when the frame was complete
+	int64_t ts_ns;
+} stream_slot_header_t;
+
+inline size_t stream_ring_align(const size_t n)
+{
+	return (n + STREAM_RING_ALIGN - 1) & ~size_t(STREAM_RING_ALIGN - 1);
+}
+
+inline size_t stream_ring_slot_size(const int w, const int h)
+{
+	return stream_ring_align(sizeof(stream_slot_header_t)) + stream_ring_align(w * h * 3);
+}
+
+inline size_t stream_ring_size(const int w, const int h, const int n_slots)
+{
+	return stream_ring_align(sizeof(stream_ring_header_t)) + n_slots * stream_ring_slot_size(w, h);
+}
+
+// n_slots, w and h as the reader checked them: the header is writable by the producer
+inline stream_slot_header_t *stream_ring_slot(const stream_ring_header_t *const r, const uint32_t n_slots, const int w, const int h, const uint32_t frame_nr)
+{
+	uint8_t *const base = (uint8_t *)r + stream_ring_align(sizeof(stream_ring_header_t));
+
+	return (stream_slot_header_t *)(base + (frame_nr % n_slots) * stream_ring_slot_size(w, h));
+}
+
+inline stream_slot_header_t *stream_ring_slot(const stream_ring_header_t *const r, const uint32_t frame_nr)
+{
+	return stream_ring_slot(r, r -> n_slots, r -> w, r -> h, frame_nr);
+}
+
+inline uint8_t *stream_slot_pixels(const stream_slot_header_t *const s)
+{
+	return (uint8_t *)s + stream_ring_align(sizeof(stream_slot_header_t));
+}
+
+// producer: returns where frame frame_nr (1, 2, ...) is to be written
+inline uint8_t *stream_ring_begin(stream_ring_header_t *const r, const uint32_t frame_nr)
+{
+	stream_slot_header_t *const s = stream_ring_slot(r, frame_nr);
+
+	s -> seq++;
+	__sync_synchronize();
+
+	return stream_slot_pixels(s);
+}
+
+// producer: the frame from stream_ring_begin() is complete
+inline void stream_ring_publish(stream_ring_header_t *const r, const uint32_t frame_nr, const int64_t ts_ns)
+{
+	stream_slot_header_t *const s = stream_ring_slot(r, frame_nr);
+
+	s -> frame_nr = frame_nr;
+	s -> ts_ns = ts_ns;
+
+	__sync_synchronize();
+	s -> seq++;
+
+	__sync_synchronize();
+	r -> frame_nr = frame_nr;
+}
+
+#define STREAM_FRAGMENT_MAGIC 0x4d535246 // "MSRF"
+
+// a piece of a frame, sent as a datagram (or length prefixed over tcp) to
+// the command port: this header with all fields big-endian, id_len bytes
+// with the id of the element, then the pixels that go at offset
+typedef struct {
+	uint32_t magic;
+	// 1, 2, ...; a frame is shown once all its total bytes arrived
+	uint32_t frame_nr;
+	uint32_t offset, total;
+	uint8_t id_len;
+} __attribute__((packed)) stream_fragment_header_t;
+
+#endif
@@ -0,0 +1,187 @@
+#include <stdio.h>
+
+#include "swap_chain.h"
+#include "utils.h"
+
+swap_chain::swap_chain(display_backend *const b_in, const int depth, const int w, const int h, const int brightness) : b(b_in), stop_flag(false)
+{
+	pthread_mutex_init(&lock, NULL);
+	pthread_cond_init(&cond, NULL);
+
+	work.reserve(MAX_DAMAGE_RECTS + 1);
+
+	if (depth <= 1 || !b -> has_offscreen()) {
+		slot_t s = { b -> get_live_canvas(), false, new frame_pusher(w, h, brightness), new damage_tracker(w, h) };
+		slots.push_back(s);
+		free_slots.push_back(0);
+
+		return;
+	}
+
+	for(int i=0; i<depth; i++) {
+		slot_t s = { b -> create_offscreen(), true, new frame_pusher(w, h, brightness), new damage_tracker(w, h) };
+		slots.push_back(s);
+
+		s.pending -> add_all();
+	}
+
+	// the canvas the display started with is not ours: swap in an (empty) one
+	// right away so that every canvas that comes back is one of the slots
+	b -> swap(slots.at(0).c);
+
+	for(int i=1; i<depth; i++)
+		free_slots.push_back(i);
+
+	pthread_create(&th, NULL, thread_main, this);
+	set_thread_name(th, "swap_chain");
+}
+
+swap_chain::~swap_chain()
+{
+	if (slots.at(0).offscreen) {
+		pthread_mutex_lock(&lock);
+		stop_flag = true;
+		pthread_cond_broadcast(&cond);
+		pthread_mutex_unlock(&lock);
+
+		void *dummy = NULL;
+		pthread_join(th, &dummy);
+	}
+
+	// the canvases are owned by the backend
+	for(size_t i=0; i<slots.size(); i++) {
+		delete slots.at(i).pending;
+		delete slots.at(i).pusher;
+	}
+
+	pthread_cond_destroy(&cond);
+	pthread_mutex_destroy(&lock);
+}
+
+void *swap_chain::thread_main(void *p)
+{
+	((swap_chain *)p) -> run();
+
+	return NULL;
+}
+
+void swap_chain::run()
+{
+	pthread_mutex_lock(&lock);
+
+	for(;;) {
+		while(ready_slots.empty() && !stop_flag)
+			pthread_cond_wait(&cond, &lock);
+
+		if (ready_slots.empty())
+			break;
+
+		const int slot = ready_slots.front();
+		ready_slots.pop_front();
+
+		pthread_mutex_unlock(&lock);
+
+		// blocks until the panel refresh has finished the previous frame
+		rgb_matrix::Canvas *prev = b -> swap(slots.at(slot).c);
+
+		pthread_mutex_lock(&lock);
+
+		for(size_t i=0; i<slots.size(); i++) {
+			if (slots.at(i).c == prev) {
+				free_slots.push_back(i);
+				break;
+			}
+		}
+
+		pthread_cond_broadcast(&cond);
+	}
+
+	pthread_mutex_unlock(&lock);
+}
+
+int swap_chain::acquire()
+{
+	pthread_mutex_lock(&lock);
+
+	while(free_slots.empty())
+		pthread_cond_wait(&cond, &lock);
+
+	const int slot = free_slots.front();
+	free_slots.pop_front();
+
+	pthread_mutex_unlock(&lock);
+
+	return slot;
+}
+
+void swap_chain::queue(const int slot)
+{
+	pthread_mutex_lock(&lock);
+
+	// without frame canvases the pixels are already on the panel
+	if (slots.at(slot).offscreen)
+		ready_slots.push_back(slot);
+	else
+		free_slots.push_back(slot);
+
+	pthread_cond_broadcast(&cond);
+
+	pthread_mutex_unlock(&lock);
+}
+
+bool swap_chain::set_brightness(const int brightness)
+{
+	bool changed = false;
+
+	for(size_t i=0; i<slots.size(); i++)
+		changed |= slots.at(i).pusher -> set_brightness(brightness);
+
+	return changed;
+}
+
+void swap_chain::present(const uint8_t *const data, const std::vector<rect_t> & rects)
+{
+	// every canvas needs these, also the ones that are on the panel now
+	for(size_t i=0; i<slots.size(); i++) {
+		for(size_t r=0; r<rects.size(); r++) {
+			const rect_t & cur = rects.at(r);
+
+			slots.at(i).pending -> add(cur.x, cur.y, cur.w, cur.h);
+		}
+	}
+
+	const int slot = acquire();
+	slot_t & s = slots.at(slot);
+
+	if (s.pending -> take(&work)) {
+		for(size_t r=0; r<work.size(); r++)
+			s.pusher -> push(s.c, data, work.at(r));
+	}
+
+	queue(slot);
+}
+
+void swap_chain::present(const uint8_t *const data)
+{
+	for(size_t i=0; i<slots.size(); i++)
+		slots.at(i).pending -> add_all();
+
+	present(data, std::vector<rect_t>());
+}
+
+void swap_chain::present_fill(const uint8_t r, const uint8_t g, const uint8_t b)
+{
+	const int slot = acquire();
+	slot_t & s = slots.at(slot);
+
+	if (r == 0 && g == 0 && b == 0)
+		s.c -> Clear();
+	else
+		s.c -> Fill(r, g, b);
+
+	// no longer shows the frame buffer
+	s.pusher -> invalidate();
+	s.pending -> add_all();
+
+	queue(slot);
+}
@@ -0,0 +1,57 @@
+#ifndef __SWAP_CHAIN_H__
+#define __SWAP_CHAIN_H__
+
+#include <deque>
+#include <pthread.h>
+#include <stdint.h>
+#include <vector>
+
+#include "backend.h"
+#include "damage.h"
+#include "frame_pusher.h"
+
+#define DEFAULT_SWAP_CHAIN_DEPTH 2
+
+// a set of offscreen canvases: the compositor fills one while another is
+// being scanned out, a separate thread swaps them in (at the vsync)
+class swap_chain {
+private:
+	typedef struct {
+		rgb_matrix::Canvas *c;
+		bool offscreen;
+		frame_pusher *pusher;
+		// what changed in the frame since this canvas was last drawn into
+		damage_tracker *pending;
+	} slot_t;
+
+	display_backend *const b;
+	std::vector<slot_t> slots;
+	std::vector<rect_t> work;
+
+	std::deque<int> free_slots, ready_slots;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t th;
+	bool stop_flag;
+
+	static void *thread_main(void *p);
+	void run();
+
+	int acquire();
+	void queue(const int slot);
+
+public:
+	// a depth of 1 draws straight into the live canvas
+	swap_chain(display_backend *const b_in, const int depth, const int w, const int h, const int brightness);
+	virtual ~swap_chain();
+
+	bool set_brightness(const int brightness);
+
+	// pushes the changed parts of the frame to a free canvas and queues it for display
+	void present(const uint8_t *const data, const std::vector<rect_t> & rects);
+	void present(const uint8_t *const data);
+
+	void present_fill(const uint8_t r, const uint8_t g, const uint8_t b);
+};
+
+#endif
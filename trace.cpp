@@ -0,0 +1,45 @@
+#include <algorithm>
+
+#include "trace.h"
+
+trace_log::trace_log() : dropped(0)
+{
+	pthread_mutex_init(&lock, NULL);
+}
+
+trace_log::~trace_log()
+{
+	pthread_mutex_destroy(&lock);
+}
+
+void trace_log::add(const std::vector<trace_record_t> & in)
+{
+	pthread_mutex_lock(&lock);
+
+	for(size_t i=0; i<in.size(); i++)
+	{
+		if (records.size() >= MAX_TRACE_RECORDS)
+			dropped++;
+		else
+			records.push_back(in.at(i));
+	}
+
+	pthread_mutex_unlock(&lock);
+}
+
+uint64_t trace_log::take(std::vector<trace_record_t> *const out, const size_t max)
+{
+	pthread_mutex_lock(&lock);
+
+	const size_t n = std::min(max, records.size());
+
+	out -> assign(records.begin(), records.begin() + n);
+	records.erase(records.begin(), records.begin() + n);
+
+	const uint64_t rc = dropped;
+	dropped = 0;
+
+	pthread_mutex_unlock(&lock);
+
+	return rc;
+}
@@ -0,0 +1,37 @@
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <pthread.h>
+#include <stdint.h>
+#include <vector>
+
+// finished traces kept until they are collected
+#define MAX_TRACE_RECORDS 65536
+
+// when a traced command got from the socket to the display, all
+// CLOCK_MONOTONIC so that a client on the same host can compare them
+typedef struct {
+	uint32_t trace;
+	int64_t received_ns, composed_ns, pushed_ns;
+} trace_record_t;
+
+// traces of commands whose element reached the display, until someone
+// collects them with the trace command
+class trace_log {
+private:
+	pthread_mutex_t lock;
+	std::vector<trace_record_t> records;
+	uint64_t dropped;
+
+public:
+	trace_log();
+	virtual ~trace_log();
+
+	void add(const std::vector<trace_record_t> & in);
+
+	// moves at most max records to out, returns how many were dropped
+	// since the previous call because nobody collected them
+	uint64_t take(std::vector<trace_record_t> *const out, const size_t max);
+};
+
+#endif
@@ -0,0 +1,51 @@
+#ifndef __TRIPLE_BUFFER_H__
+#define __TRIPLE_BUFFER_H__
+
+#include <atomic>
+
+// hands complete frames from one producer to one consumer without either
+// of them ever waiting: the producer fills the back slot and swaps it with
+// the middle one, the consumer swaps the middle slot with its front slot
+// when a new one was published
+template <typename T>
+class triple_buffer {
+private:
+	static const int NEW_FRAME = 4;
+
+	T slots[3];
+	int back, front;
+	std::atomic_int middle; // slot index | NEW_FRAME
+
+public:
+	triple_buffer() : back(0), front(1) {
+		middle = 2;
+
+		for(int i=0; i<3; i++)
+			slots[i] = T();
+	}
+
+	// producer side: the slot that is safe to (over)write, it is not used by the consumer
+	T & get_back() { return slots[back]; }
+
+	void publish() {
+		back = middle.exchange(back | NEW_FRAME) & 3;
+	}
+
+	// consumer side: switches to the latest published frame, if there is one
+	bool acquire() {
+		if ((middle.load() & NEW_FRAME) == 0)
+			return false;
+
+		front = middle.exchange(front) & 3;
+
+		return true;
+	}
+
+	const T & get_front() const { return slots[front]; }
+	T & get_front() { return slots[front]; }
+
+	// for cleaning up, when neither side is active anymore
+	T & get_slot(const int nr) { return slots[nr]; }
+};
+
+#endif